@@ -0,0 +1,502 @@
+/*
+ * bench.c: A benchmark driver for the web server.
+ *
+ * For each combination of the swept parameters (server threads, queue size,
+ * cache size, client concurrency and request distribution), bench starts the
+ * server, waits until it is listening, warms it up, and then runs the client
+ * until the 95% confidence interval of the client run time is tight enough.
+ * It then shuts down the server and collects the counters that the server
+ * prints when it exits.
+ *
+ * The results are written as CSV, in the same "x, mean, stddev" format as the
+ * run-experiment scripts, so that the plot-*.gpl files can read them, and as
+ * JSON with all the run times and server counters.
+ *
+ * E.g., to produce the input of plot-threads.gpl:
+ *	./bench -t 0,1,2,4,8,16,32,64,128 -o plot-threads.out port
+ */
+
+#include <popt.h>
+#include <time.h>
+#include "common.h"
+
+#define MAX_VALUES 64	/* max values in a sweep list */
+#define MAX_RUNS 1000
+#define MAX_STATS 64	/* max server counters */
+
+static char *fifo = "./server_exit";
+static char *server_log = "bench-server.log";
+
+/* a comma separated list of values to sweep over */
+struct sweep {
+	char *name;
+	char *values[MAX_VALUES];
+	int nr_values;
+};
+
+enum {
+	SWEEP_THREADS,
+	SWEEP_REQUESTS,
+	SWEEP_CACHE,
+	SWEEP_CONCURRENCY,
+	SWEEP_DIST,
+	NR_SWEEPS,
+};
+
+struct stat_value {
+	char name[64];
+	char value[64];
+};
+
+struct result {
+	char *params[NR_SWEEPS];
+	double runs[MAX_RUNS];
+	int nr_runs;
+	double mean;
+	double stddev;
+	double ci;		/* half width of 95% confidence interval */
+	struct stat_value stats[MAX_STATS];
+	int nr_stats;
+};
+
+struct bench {
+	int port;
+	char *fileset;
+	int nr_times;		/* requests per client connection */
+	int warmup;		/* nr of untimed client runs */
+	int min_runs;
+	int max_runs;
+	double target;		/* relative half width of the confidence
+				 * interval at which we stop */
+	char *client_opts;	/* extra client options */
+	struct sweep sweeps[NR_SWEEPS];
+	int x;			/* the sweep used as the first column */
+};
+
+poptContext context;	/* context for parsing command-line options */
+
+static void
+usage()
+{
+	fprintf(stderr, "Usage: bench [options] port\n");
+	poptPrintUsage(context, stderr, 0);
+	exit(1);
+}
+
+static void
+parse_sweep(struct sweep *sw, char *name, char *list)
+{
+	char *tok, *save;
+
+	sw->name = name;
+	sw->nr_values = 0;
+	list = strdup(list);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (sw->nr_values == MAX_VALUES) {
+			fprintf(stderr, "too many values for %s\n", name);
+			usage();
+		}
+		sw->values[sw->nr_values++] = tok;
+	}
+	if (sw->nr_values == 0) {
+		fprintf(stderr, "no values for %s\n", name);
+		usage();
+	}
+}
+
+/* 97.5% quantile of the t distribution with df degrees of freedom */
+static double
+t_quantile(int df)
+{
+	static const double t[] = {
+		0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+		2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+		2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+		2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < sizeof(t) / sizeof(t[0]))
+		return t[df];
+	return 1.960;
+}
+
+static void
+result_summarize(struct result *res)
+{
+	double sum = 0, dev = 0;
+	int i;
+
+	for (i = 0; i < res->nr_runs; i++) {
+		sum += res->runs[i];
+	}
+	res->mean = sum / res->nr_runs;
+	for (i = 0; i < res->nr_runs; i++) {
+		dev += (res->runs[i] - res->mean) * (res->runs[i] - res->mean);
+	}
+	/* sample standard deviation */
+	res->stddev = res->nr_runs > 1 ? sqrt(dev / (res->nr_runs - 1)) : 0;
+	res->ci = res->nr_runs > 1 ?
+		t_quantile(res->nr_runs - 1) * res->stddev /
+		sqrt(res->nr_runs) : 0;
+}
+
+/* start the server, and return once it is listening */
+static pid_t
+server_start(struct bench *b, struct result *res)
+{
+	char port[16];
+	struct stat sbuf;
+	pid_t pid;
+	int fd, i, status;
+
+	/* the server creates the fifo after it starts listening */
+	unlink(fifo);
+	snprintf(port, sizeof(port), "%d", b->port);
+	SYS(pid = fork());
+	if (pid == 0) {
+		SYS(fd = open(server_log, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+		SYS(dup2(fd, STDOUT_FILENO));
+		SYS(close(fd));
+		execl("./server", "./server", port, res->params[SWEEP_THREADS],
+		      res->params[SWEEP_REQUESTS], res->params[SWEEP_CACHE],
+		      (char *)NULL);
+		perror("exec ./server");
+		_exit(1);
+	}
+	/* wait for up to 10 seconds */
+	for (i = 0; i < 1000; i++) {
+		if (stat(fifo, &sbuf) == 0 && S_ISFIFO(sbuf.st_mode))
+			return pid;
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			fprintf(stderr, "server exited during startup, "
+				"see %s\n", server_log);
+			exit(1);
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "server did not start\n");
+	kill(pid, SIGKILL);
+	exit(1);
+}
+
+/* ask the server to exit through its fifo, and wait for it */
+static void
+server_stop(pid_t pid)
+{
+	int fd, i, status;
+
+	SYS(fd = open(fifo, O_WRONLY | O_NONBLOCK));
+	Rio_write(fd, "shutdown\n", 9);
+	SYS(close(fd));
+	for (i = 0; i < 1000; i++) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "server did not exit cleanly, "
+					"see %s\n", server_log);
+				exit(1);
+			}
+			return;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "server did not shutdown, killing it\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	exit(1);
+}
+
+/* collect the "server: name = value" lines from the server log */
+static void
+server_read_stats(struct result *res)
+{
+	FILE *f;
+	char line[MAXLINE];
+	struct stat_value *sv;
+
+	res->nr_stats = 0;
+	f = fopen(server_log, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f) && res->nr_stats < MAX_STATS) {
+		sv = &res->stats[res->nr_stats];
+		if (sscanf(line, "server: %63s = %63s", sv->name,
+			   sv->value) == 2)
+			res->nr_stats++;
+	}
+	fclose(f);
+}
+
+/* run the client once, and return its run time in seconds */
+static double
+client_run(struct bench *b, struct result *res)
+{
+	char cmd[MAXLINE];
+	char line[MAXLINE];
+	double runtime = -1;
+	FILE *f;
+
+	snprintf(cmd, sizeof(cmd), "./client -t %s -d %s 127.0.0.1 %d %d %s %s",
+		 b->client_opts, res->params[SWEEP_DIST], b->port, b->nr_times,
+		 res->params[SWEEP_CONCURRENCY], b->fileset);
+	f = popen(cmd, "r");
+	if (!f) {
+		perror("popen");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "client runtime = %lf seconds", &runtime);
+	}
+	if (pclose(f) != 0) {
+		fprintf(stderr, "error: %s\n", cmd);
+		return -1;
+	}
+	return runtime;
+}
+
+static int
+bench_one(struct bench *b, struct result *res)
+{
+	pid_t pid;
+	double t;
+	int i;
+
+	pid = server_start(b, res);
+	for (i = 0; i < b->warmup; i++) {
+		if (client_run(b, res) < 0)
+			goto error;
+	}
+	res->nr_runs = 0;
+	while (res->nr_runs < b->max_runs) {
+		if ((t = client_run(b, res)) < 0)
+			goto error;
+		res->runs[res->nr_runs++] = t;
+		result_summarize(res);
+		if (res->nr_runs >= b->min_runs &&
+		    res->ci <= b->target * res->mean)
+			break;
+	}
+	server_stop(pid);
+	server_read_stats(res);
+	return 0;
+error:
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void
+write_csv_header(FILE *f, struct bench *b, struct result *res)
+{
+	int i;
+
+	fprintf(f, "# %s, mean, stddev, ci95, runs", b->sweeps[b->x].name);
+	for (i = 0; i < NR_SWEEPS; i++) {
+		fprintf(f, ", %s", b->sweeps[i].name);
+	}
+	for (i = 0; i < res->nr_stats; i++) {
+		fprintf(f, ", %s", res->stats[i].name);
+	}
+	fprintf(f, "\n");
+}
+
+/* one line per configuration. the first three columns are the same as in the
+ * output of run-one-experiment */
+static void
+write_csv(FILE *f, struct bench *b, struct result *res)
+{
+	int i;
+
+	fprintf(f, "%s, %.4f, %.4f, %.4f, %d", res->params[b->x], res->mean,
+		res->stddev, res->ci, res->nr_runs);
+	for (i = 0; i < NR_SWEEPS; i++) {
+		fprintf(f, ", %s", res->params[i]);
+	}
+	for (i = 0; i < res->nr_stats; i++) {
+		fprintf(f, ", %s", res->stats[i].value);
+	}
+	fprintf(f, "\n");
+	fflush(f);
+}
+
+static void
+write_json(FILE *f, struct bench *b, struct result *res, int first)
+{
+	int i;
+
+	fprintf(f, "%s\n    {", first ? "" : ",");
+	for (i = 0; i < NR_SWEEPS; i++) {
+		if (i == SWEEP_DIST)
+			fprintf(f, "\"%s\": \"%s\", ", b->sweeps[i].name,
+				res->params[i]);
+		else
+			fprintf(f, "\"%s\": %s, ", b->sweeps[i].name,
+				res->params[i]);
+	}
+	fprintf(f, "\"mean\": %.6f, \"stddev\": %.6f, \"ci95\": %.6f, "
+		"\"runs\": [", res->mean, res->stddev, res->ci);
+	for (i = 0; i < res->nr_runs; i++) {
+		fprintf(f, "%s%.6f", i ? ", " : "", res->runs[i]);
+	}
+	fprintf(f, "], \"server\": {");
+	for (i = 0; i < res->nr_stats; i++) {
+		fprintf(f, "%s\"%s\": %s", i ? ", " : "", res->stats[i].name,
+			res->stats[i].value);
+	}
+	fprintf(f, "}}");
+	fflush(f);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	char c;
+	struct bench b;
+	struct result res;
+	char *out = "bench.csv";
+	char json_name[1024];
+	char *ext, *x = NULL;
+	const char *port;
+	char *lists[NR_SWEEPS] = { "8", "8", "0", "10", "uniform" };
+	char *names[NR_SWEEPS] = { "threads", "requests", "cache",
+				   "concurrency", "dist" };
+	int idx[NR_SWEEPS];
+	FILE *csv, *json;
+	time_t now;
+	int i, nr = 0, failed = 0;
+
+	b.fileset = "fileset_dir.idx";
+	b.nr_times = 100;
+	b.warmup = 1;
+	b.min_runs = 5;
+	b.max_runs = 30;
+	b.target = 0.02;
+	b.client_opts = "";
+
+	struct poptOption options_table[] = {
+		{NULL, 't', POPT_ARG_STRING, &lists[SWEEP_THREADS], 0,
+		 "list of server thread counts", " default: 8"},
+		{NULL, 'r', POPT_ARG_STRING, &lists[SWEEP_REQUESTS], 0,
+		 "list of server queue sizes", " default: 8"},
+		{NULL, 'c', POPT_ARG_STRING, &lists[SWEEP_CACHE], 0,
+		 "list of server cache sizes", " default: 0"},
+		{NULL, 'C', POPT_ARG_STRING, &lists[SWEEP_CONCURRENCY], 0,
+		 "list of client concurrency levels", " default: 10"},
+		{NULL, 'd', POPT_ARG_STRING, &lists[SWEEP_DIST], 0,
+		 "list of client request distributions", " default: uniform"},
+		{NULL, 'x', POPT_ARG_STRING, &x, 0,
+		 "parameter used as the first column",
+		 " default: the first parameter with several values"},
+		{NULL, 'n', POPT_ARG_INT, &b.nr_times, 0,
+		 "requests per client connection", " default: 100"},
+		{NULL, 'f', POPT_ARG_STRING, &b.fileset, 0,
+		 "fileset index", " default: fileset_dir.idx"},
+		{NULL, 'w', POPT_ARG_INT, &b.warmup, 0,
+		 "untimed warm up runs", " default: 1"},
+		{NULL, 'm', POPT_ARG_INT, &b.min_runs, 0,
+		 "min timed runs", " default: 5"},
+		{NULL, 'M', POPT_ARG_INT, &b.max_runs, 0,
+		 "max timed runs", " default: 30"},
+		{NULL, 'e', POPT_ARG_DOUBLE, &b.target, 0,
+		 "stop when the 95% confidence interval is within e of mean",
+		 " default: 0.02"},
+		{NULL, 'A', POPT_ARG_STRING, &b.client_opts, 0,
+		 "extra client options", NULL},
+		{NULL, 'o', POPT_ARG_STRING, &out, 0,
+		 "CSV output file, the JSON output replaces its extension",
+		 " default: bench.csv"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if ((port = poptGetArg(context)) == NULL || poptGetArg(context))
+		usage();
+	b.port = atoi(port);
+	if (b.port < 1024) {
+		fprintf(stderr, "port = %d, should be >= 1024\n", b.port);
+		usage();
+	}
+	if (b.nr_times <= 0 || b.warmup < 0 || b.min_runs < 2 ||
+	    b.max_runs < b.min_runs || b.max_runs > MAX_RUNS ||
+	    b.target <= 0) {
+		fprintf(stderr, "run parameters are out of bounds\n");
+		usage();
+	}
+	b.x = -1;
+	for (i = 0; i < NR_SWEEPS; i++) {
+		parse_sweep(&b.sweeps[i], names[i], lists[i]);
+		if (x ? strcmp(x, names[i]) == 0 :
+		    (b.x < 0 && b.sweeps[i].nr_values > 1))
+			b.x = i;
+	}
+	if (b.x < 0) {
+		if (x) {
+			fprintf(stderr, "unknown parameter: %s\n", x);
+			usage();
+		}
+		b.x = SWEEP_THREADS;
+	}
+
+	if (strlen(out) > sizeof(json_name) - 8) {
+		fprintf(stderr, "output file name is too long\n");
+		usage();
+	}
+	strcpy(json_name, out);
+	if ((ext = strrchr(json_name, '.')) && !strchr(ext, '/'))
+		*ext = 0;
+	strcat(json_name, ".json");
+	if (!(csv = fopen(out, "w")) || !(json = fopen(json_name, "w"))) {
+		perror("fopen");
+		exit(1);
+	}
+	now = time(NULL);
+	fprintf(json, "{\n  \"build\": \"%s %s\",\n  \"date\": %ld,\n"
+		"  \"fileset\": \"%s\",\n  \"nr_times\": %d,\n"
+		"  \"client_opts\": \"%s\",\n  \"results\": [", __DATE__,
+		__TIME__, (long)now, b.fileset, b.nr_times, b.client_opts);
+
+	/* iterate over all combinations of the sweep values */
+	memset(idx, 0, sizeof(idx));
+	while (1) {
+		for (i = 0; i < NR_SWEEPS; i++) {
+			res.params[i] = b.sweeps[i].values[idx[i]];
+		}
+		fprintf(stderr, "threads %s, requests %s, cache %s, "
+			"concurrency %s, dist %s: ", res.params[SWEEP_THREADS],
+			res.params[SWEEP_REQUESTS], res.params[SWEEP_CACHE],
+			res.params[SWEEP_CONCURRENCY], res.params[SWEEP_DIST]);
+		if (bench_one(&b, &res) < 0) {
+			fprintf(stderr, "failed\n");
+			failed = 1;
+		} else {
+			fprintf(stderr, "%.4f +- %.4f seconds, %d runs\n",
+				res.mean, res.ci, res.nr_runs);
+			if (nr == 0)
+				write_csv_header(csv, &b, &res);
+			write_csv(csv, &b, &res);
+			write_json(json, &b, &res, nr == 0);
+			nr++;
+		}
+		/* next combination, the first sweep changes fastest */
+		for (i = 0; i < NR_SWEEPS; i++) {
+			if (++idx[i] < b.sweeps[i].nr_values)
+				break;
+			idx[i] = 0;
+		}
+		if (i == NR_SWEEPS)
+			break;
+	}
+	fprintf(json, "\n  ]\n}\n");
+	fclose(json);
+	fclose(csv);
+	if (!failed)
+		unlink(server_log);
+	exit(failed);
+}
@@ -3,38 +3,340 @@
  * 
  */
 
+#define _GNU_SOURCE	/* for memmem */
+#include <popt.h>
+#include <zlib.h>
 #include "common.h"
+#include "fileidx.h"
+#include "client.h"
+
+/* ask for file fnr of size bytes in cl->nr_ranges ranges that cover it, cut
+ * at random points. the last range is asked for by its length, so that both
+ * forms of a range are used. returns the length of the Range header. */
+static int
+client_range(struct client *cl, long size, char *buf, size_t max)
+{
+	long seg = size / cl->nr_ranges;
+	long first = 0, cut;
+	int i, n;
+
+	n = snprintf(buf, max, "Range: bytes=");
+	for (i = 1; i < cl->nr_ranges; i++) {
+		/* cuts are in the first half of each segment, so they grow */
+		cut = i * seg + (seg > 1 ? rand_int(seg / 2) - 1 : 0);
+		n += snprintf(buf + n, max - n, "%ld-%ld,", first, cut - 1);
+		first = cut;
+	}
+	if (cl->nr_ranges == 1)
+		n += snprintf(buf + n, max - n, "0-\r\n");
+	else
+		n += snprintf(buf + n, max - n, "-%ld\r\n", size - first);
+	return n;
+}
+
+/* put together an HTTP request for file fnr in buf, returns its length */
+int
+client_request_line(struct client *cl, int fnr, char *buf, size_t max)
+{
+	long size = fileidx_size(cl->fileset, fnr);
+	int n;
+
+	/* create the request line */
+	/* pipelined requests need a connection that persists */
+	n = snprintf(buf, max, "GET %s HTTP/1.%d\r\n",
+		     fileidx_name(cl->fileset, fnr), cl->depth > 0);
+	/* create one request header line for the server host */
+	n += snprintf(buf + n, max - n, "host: %s\r\n", cl->host);
+	/* ask for the file only if it changed since we got it */
+	if (cl->revalidate) {
+		pthread_mutex_lock(&cl->etag_lock);
+		if (cl->etags[fnr][0]) {
+			n += snprintf(buf + n, max - n,
+				      "If-None-Match: %s\r\n",
+				      cl->etags[fnr]);
+		}
+		pthread_mutex_unlock(&cl->etag_lock);
+	}
+	if (cl->gzip)
+		n += snprintf(buf + n, max - n, "Accept-Encoding: gzip\r\n");
+	/* a file with fewer bytes than ranges is asked for whole */
+	if (cl->nr_ranges > 0 && size >= cl->nr_ranges)
+		n += client_range(cl, size, buf + n, max - n);
+	/* and then the empty line */
+	n += snprintf(buf + n, max - n, "\r\n");
+	assert(n < max);
+	return n;
+}
+
+/* open a connection to the server */
+int
+client_connect(struct client *cl)
+{
+	if (cl->unix_path)
+		return open_unix_clientfd(cl->unix_path);
+	return open_clientfd(cl->host, cl->port);
+}
 
 /* send an HTTP request for the specified file */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, struct client *cl, int fnr)
 {
 	char buf[MAXLINE];
 
-	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
-	/* create one request header line for the server host, 
-	   and then the empty line */
-	sprintf(buf + strlen(buf), "host: %s\r\n\r\n", host);
-	Rio_write(fd, buf, strlen(buf));
+	Rio_write(fd, buf, client_request_line(cl, fnr, buf, sizeof(buf)));
+}
+
+/* check that the response matches the file in the index, and that we
+ * received all of it */
+void
+client_check(unsigned int orig_csum, int orig_length, unsigned int csum,
+	     int length, unsigned int csum_received, int length_received)
+{
+	assert(orig_csum == csum);
+	assert(orig_length == length);
+
+	assert(length == length_received);
+	assert(csum == csum_received);
+}
+
+void
+client_response_init(struct response *resp)
+{
+	resp->status = 0;
+	resp->length = 0;
+	resp->csum = 0;
+	resp->etag[0] = 0;
+	resp->range_first = -1;
+	resp->range_last = -1;
+	resp->range_size = -1;
+	resp->boundary[0] = 0;
+	resp->gzip = 0;
+	resp->close = 1;
+	resp->length_received = 0;
+	resp->csum_received = 0;
+	resp->body = NULL;
+	resp->body_max = 0;
+}
+
+/* look for the HTTP tags that we check in a line of the header */
+void
+client_header(struct response *resp, char *line)
+{
+	char *p;
+
+	if (sscanf(line, "HTTP/%*s %d", &resp->status) == 1) {
+		/* found the status line. HTTP/1.1 connections persist */
+		resp->close = strncmp(line, "HTTP/1.1", 8) != 0;
+	}
+	if (strncasecmp(line, "Connection: close", 17) == 0) {
+		resp->close = 1;
+	}
+	if (strncasecmp(line, "Connection: keep-alive", 22) == 0) {
+		resp->close = 0;
+	}
+	if (sscanf(line, "Content-Length: %d ", &resp->length) == 1) {
+		/* found length tag */
+	}
+	if (sscanf(line, "Content-Csum: %u ", &resp->csum) == 1) {
+		/* found csum tag */
+	}
+	if (sscanf(line, "ETag: %63s ", resp->etag) == 1) {
+		/* found entity tag */
+	}
+	if (sscanf(line, "Content-Range: bytes %ld-%ld/%ld ",
+		   &resp->range_first, &resp->range_last,
+		   &resp->range_size) == 3) {
+		/* found the range of a single range response */
+	}
+	if (strncmp(line, "Content-Type: multipart/byteranges", 34) == 0 &&
+	    (p = strstr(line, "boundary=")) != NULL) {
+		sscanf(p + 9, "%71[^\r\n; ]", resp->boundary);
+	}
+	if (strncasecmp(line, "Content-Encoding: gzip", 22) == 0) {
+		/* the checksum is still that of the file */
+		resp->gzip = 1;
+	}
 }
 
-/* read the HTTP response and print it out */
+/* add n bytes of the body that were received */
+void
+client_body(struct response *resp, char *buf, int n)
+{
+	int i;
+
+	if (resp->boundary[0] || resp->gzip) {
+		if (resp->length_received + n > resp->body_max) {
+			resp->body_max = (resp->length_received + n) * 2;
+			resp->body = realloc(resp->body, resp->body_max);
+			if (!resp->body)
+				unix_error("realloc");
+		}
+		memcpy(resp->body + resp->length_received, buf, n);
+	}
+	resp->length_received += n;
+	for (i = 0; i < n; i++) {
+		resp->csum_received += (unsigned char)buf[i];
+	}
+}
+
+/* check that the parts of a multipart response, in the order they were asked
+ * for, add up to the file. see client_range. */
 static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+client_check_parts(struct client *cl, int fnr, struct response *resp)
 {
-	struct rio *rio;
-	char buf[MAXBUF];
-	int i, n;
-	int length = 0;
-	int length_received = 0;
+	char delim[BOUNDARY_LEN + 8], hdr[MAXLINE];
+	char *p = resp->body, *end = resp->body + resp->length_received;
+	char *range, *hdr_end;
+	long first, last, size, next = 0;
 	unsigned int csum = 0;
-	unsigned int csum_received = 0;
+	int nr_parts = 0, ret;
+
+	assert(resp->length == resp->length_received);
+	snprintf(delim, sizeof(delim), "\r\n--%s", resp->boundary);
+	while (1) {
+		assert(end - p >= strlen(delim) + 2);
+		assert(memcmp(p, delim, strlen(delim)) == 0);
+		p += strlen(delim);
+		if (memcmp(p, "--", 2) == 0)	/* the closing delimiter */
+			break;
+		/* the part header ends with an empty line */
+		hdr_end = memmem(p, end - p, "\r\n\r\n", 4);
+		assert(hdr_end && hdr_end - p < sizeof(hdr));
+		memcpy(hdr, p, hdr_end - p);
+		hdr[hdr_end - p] = 0;
+		range = strstr(hdr, "Content-Range: ");
+		assert(range);
+		/* parsed outside the assert, which -DNDEBUG compiles out */
+		ret = sscanf(range, "Content-Range: bytes %ld-%ld/%ld", &first,
+			     &last, &size);
+		assert(ret == 3);
+		assert(first == next && last >= first);
+		assert(size == fileidx_size(cl->fileset, fnr));
+		p = hdr_end + 4;
+		assert(end - p >= last - first + 1);
+		for (; first <= last; first++) {
+			csum += (unsigned char)*p++;
+		}
+		next = last + 1;
+		nr_parts++;
+	}
+	assert(nr_parts == cl->nr_ranges);
+	assert(next == fileidx_size(cl->fileset, fnr));
+	assert(csum == fileidx_csum(cl->fileset, fnr));
+	(void)ret;	/* only checked by the asserts */
+	(void)next;
+}
+
+/* inflate a gzip encoded body, and check that it is file fnr */
+static void
+client_check_gzip(struct client *cl, int fnr, struct response *resp)
+{
+	int orig_length = fileidx_size(cl->fileset, fnr);
+	unsigned int csum = 0;
+	unsigned char *buf;
+	z_stream zs;
+	int i, ret;
+
+	assert(resp->length == resp->length_received);
+	/* a byte more than the file, to notice a longer one */
+	buf = Malloc(orig_length + 1);
+	memset(&zs, 0, sizeof(zs));
+	ret = inflateInit2(&zs, 16 + MAX_WBITS);
+	assert(ret == Z_OK);
+	zs.next_in = (unsigned char *)resp->body;
+	zs.avail_in = resp->length_received;
+	zs.next_out = buf;
+	zs.avail_out = orig_length + 1;
+	ret = inflate(&zs, Z_FINISH);
+	assert(ret == Z_STREAM_END);
+	(void)ret;	/* only checked by the asserts */
+	for (i = 0; i < zs.total_out; i++) {
+		csum += buf[i];
+	}
+	client_check(fileidx_csum(cl->fileset, fnr), orig_length, resp->csum,
+		     zs.total_out, csum, zs.total_out);
+	inflateEnd(&zs);
+	free(buf);
+}
+
+/* check the response to a request for file fnr, and count it */
+void
+client_done(struct client *cl, int fnr, struct response *resp)
+{
+	unsigned int orig_csum = fileidx_csum(cl->fileset, fnr);
+	int orig_length = fileidx_size(cl->fileset, fnr);
+
+	if (resp->status == HTTP_SHED) {
+		/* an overloaded server sheds the request, the body is its
+		 * own */
+		__sync_fetch_and_add(&cl->nr_shed, 1);
+		client_check(resp->csum, resp->length, resp->csum,
+			     resp->length, resp->csum_received,
+			     resp->length_received);
+		goto out;
+	}
+	if (resp->status == HTTP_NOT_MODIFIED) {
+		/* no body, and the file is the one we have */
+		assert(cl->revalidate);
+		assert(resp->length_received == 0);
+		pthread_mutex_lock(&cl->etag_lock);
+		assert(strcmp(resp->etag, cl->etags[fnr]) == 0);
+		pthread_mutex_unlock(&cl->etag_lock);
+		__sync_fetch_and_add(&cl->nr_not_modified, 1);
+		goto out;
+	}
+	if (resp->status == HTTP_PARTIAL) {
+		/* the ranges cover the file, so all of it was received */
+		assert(cl->nr_ranges > 0);
+		if (resp->boundary[0]) {
+			client_check_parts(cl, fnr, resp);
+		} else {
+			assert(cl->nr_ranges == 1);
+			assert(resp->range_first == 0 &&
+			       resp->range_last == orig_length - 1 &&
+			       resp->range_size == orig_length);
+			client_check(orig_csum, orig_length, orig_csum,
+				     resp->length, resp->csum_received,
+				     resp->length_received);
+		}
+		__sync_fetch_and_add(&cl->nr_partial, 1);
+	} else if (resp->gzip) {
+		assert(cl->gzip);
+		client_check_gzip(cl, fnr, resp);
+		__sync_fetch_and_add(&cl->nr_compressed, 1);
+	} else {
+		client_check(orig_csum, orig_length, resp->csum,
+			     resp->length, resp->csum_received,
+			     resp->length_received);
+	}
+	if (cl->revalidate && resp->etag[0]) {
+		pthread_mutex_lock(&cl->etag_lock);
+		snprintf(cl->etags[fnr], ETAG_LEN, "%s", resp->etag);
+		pthread_mutex_unlock(&cl->etag_lock);
+	}
+out:
+	free(resp->body);
+	resp->body = NULL;
+}
+
+/* read the HTTP response to a request for file fnr and print it out. the body
+ * ends with the connection, unless the connection persists, when it is
+ * Content-Length bytes long. Returns 1 if the connection persists, 0 if it
+ * doesn't, and -1 if it was closed before the response. */
+static int
+client_read(struct rio *rio, struct client *cl, int fnr, int print)
+{
+	char buf[MAXBUF];
+	struct response resp;
+	int n, left;
 	
-	rio = Rio_init(fd);
+	client_response_init(&resp);
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
+	if (n == 0)
+		return -1;
+	client_header(&resp, buf);
 	while (strcmp(buf, "\r\n") && (n > 0)) {
 		if (print) {
 			printf("Header: %s", buf);
@@ -42,174 +344,349 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		n = Rio_readlineb(rio, buf, MAXBUF);
 
 		/* look for certain HTTP tags... */
-		if (sscanf(buf, "Content-Length: %d ", &length) == 1) {
-			/* found length tag */
-		}
-		if (sscanf(buf, "Content-Csum: %u ", &csum) == 1) {
-			/* found csum tag */
-		}
+		client_header(&resp, buf);
 	}
 
 	fflush(stdout);
 	/* read and display the HTTP body */
-	do {
-		n = Rio_readlineb(rio, buf, MAXBUF);
+	left = resp.close ? -1 : resp.length;
+	while (left != 0) {
+		if (resp.close) {
+			n = Rio_readlineb(rio, buf, MAXBUF);
+		} else {
+			n = Rio_readb(rio, buf, left < MAXBUF ? left : MAXBUF);
+			left -= n;
+		}
+		if (n == 0)
+			break;
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
-		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
-	} while (n > 0);
+		client_body(&resp, buf, n);
+	}
 
-	assert(orig_csum == csum);
-	assert(orig_length == length);
+	client_done(cl, fnr, &resp);
+	return !resp.close;
+}
 
-	assert(length == length_received);
-	assert(csum == csum_received);
-	Rio_destroy(rio);
+/* seed the calling thread's generator. with a fixed seed, each thread gets
+ * its own repeatable stream of files, whichever order the threads run in. */
+void
+client_seed_thread(struct client *cl)
+{
+	int nr = __sync_fetch_and_add(&cl->nr_seeded, 1);
+
+	if (cl->seed >= 0)
+		init_random_seed(cl->seed + nr);
+	else
+		init_random();
 }
 
-struct fileinfo {
-	char *name;
-	unsigned int csum;
-	int len;
-};
+/* returns the index of the next file to request. nr is the number of requests
+ * that this thread has made so far. */
+int
+client_pick_file(struct client *cl, int nr)
+{
+	int hot_nr, start;
 
-struct client {
-	char *host;
-	int port;
-	int nr_times;
-	int nr_threads;
-	struct fileinfo *fileset;
-	int nr_files;
-	int timing_mode;
-};
+	switch (cl->dist) {
+	case DIST_ZIPF:
+		return rand_zipf_int(cl->zipf_s, cl->nr_files) - 1;
+	case DIST_SELF_SIMILAR:
+		return rand_self_similar_int(cl->self_similar_a,
+					     cl->nr_files) - 1;
+	case DIST_HOT_SET:
+		hot_nr = ceil(cl->hot_frac * cl->nr_files);
+		if (hot_nr >= cl->nr_files)
+			return rand_int(cl->nr_files) - 1;
+		/* the hot set moves to the next hot_nr files every hot_shift
+		 * requests, so the cache has to keep adapting to it */
+		start = 0;
+		if (cl->hot_shift > 0)
+			start = (long)(nr / cl->hot_shift) * hot_nr %
+				cl->nr_files;
+		if (rand_int(1000000) <= cl->hot_prob * 1000000)
+			return (start + rand_int(hot_nr) - 1) % cl->nr_files;
+		/* pick a cold file */
+		return (start + hot_nr + rand_int(cl->nr_files - hot_nr) - 1) %
+			cl->nr_files;
+	case DIST_UNIFORM:
+	default:
+		return rand_int(cl->nr_files) - 1;
+	}
+}
 
 /* open a single connection to the specified host and port */
 static void *
 client_request(void *arg)
 {
 	struct client *cl = (struct client *)arg;
+	struct rio *rio;
 	int clientfd;
 	int i;
 
+	client_seed_thread(cl);
 	for (i = 0; i < cl->nr_times; i++) {
 		int fnr;
 
-		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		/* we used to use a self similar distribution but that allowed
-		 * using simplistic caching policies. Now we use a uniform
-		 * distribution. */
-		/* fnr = rand_self_similar_int(0.2, cl->nr_files); */
-		fnr = rand_int(cl->nr_files);		
-		fnr--;
+		clientfd = client_connect(cl);
+		/* get a random file from the file set. the default is a uniform
+		 * distribution, because a self similar distribution allows
+		 * using simplistic caching policies. */
+		fnr = client_pick_file(cl, i);
 		/* for debugging */
 		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
+		// fileidx_name(cl->fileset, fnr));
+		client_send(clientfd, cl, fnr);
+		rio = Rio_init(clientfd);
 		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+		if (client_read(rio, cl, fnr, (cl->timing_mode == 0)) < 0) {
+			fprintf(stderr, "connection closed before the "
+				"response\n");
+			exit(1);
+		}
+		Rio_destroy(rio);
+		SYS(close(clientfd));
+	}
+	return NULL;
+}
+
+/* make nr_times requests on persistent connections, sending up to cl->depth
+ * of them before reading their responses in order. if the server closes the
+ * connection, e.g., because it was idle, the requests that it didn't answer
+ * are sent again on a new one. */
+static void *
+client_pipeline(void *arg)
+{
+	struct client *cl = (struct client *)arg;
+	struct rio *rio = NULL;
+	int *fnrs = Malloc(sizeof(int) * cl->depth);
+	char *buf = Malloc(MAXLINE * cl->depth);
+	int clientfd = -1;
+	int i, k, nr, done, n;
+
+	client_seed_thread(cl);
+	for (i = 0; i < cl->nr_times; i += nr) {
+		nr = cl->nr_times - i < cl->depth ? cl->nr_times - i :
+			cl->depth;
+		for (k = 0; k < nr; k++) {
+			fnrs[k] = client_pick_file(cl, i + k);
+		}
+		done = 0;
+		while (done < nr) {
+			if (clientfd < 0) {
+				clientfd = client_connect(cl);
+				rio = Rio_init(clientfd);
+				__sync_fetch_and_add(&cl->nr_connections, 1);
+			}
+			/* all the requests go out in one write */
+			n = 0;
+			for (k = done; k < nr; k++) {
+				n += client_request_line(cl, fnrs[k], buf + n,
+							 MAXLINE);
+			}
+			Rio_write(clientfd, buf, n);
+			while (done < nr) {
+				int ret = client_read(rio, cl, fnrs[done],
+						      (cl->timing_mode == 0));
+				if (ret >= 0)
+					done++;
+				if (ret <= 0) {
+					Rio_destroy(rio);
+					SYS(close(clientfd));
+					clientfd = -1;
+					break;
+				}
+			}
+		}
+	}
+	if (clientfd >= 0) {
+		Rio_destroy(rio);
 		SYS(close(clientfd));
 	}
+	free(buf);
+	free(fnrs);
 	return NULL;
 }
 
+poptContext context;	/* context for parsing command-line options */
+
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [options] host port nr_times nr_threads "
+		"fileset\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
-/* filename should have a list of files to be requested, one per line */
-static void
-init_fileset(char *filename, struct client *cl)
+static enum dist
+parse_dist(char *program, char *name)
 {
-	int i, n;
-	int fd;
-	struct rio *rio;
-	char buf[MAXLINE];
-
-	/* read the index file for the fileset */
-	SYS(fd = open(filename, O_RDONLY, 0));
-	rio = Rio_init(fd);
-	i = 0;
-	while (1) {
-		struct fileinfo *fi;
-		n = Rio_readlineb(rio, buf, MAXLINE);
-		if (n == 0) {
-			assert(cl->nr_files > 0);
-			assert(i == cl->nr_files);
-			break;
-		}
-		if (buf[n - 1] == '\n') {
-			n--;
-		}
-		if (cl->nr_files == 0) {
-			cl->nr_files = atoi(buf);
-			assert(cl->nr_files > 0);
-			cl->fileset = Malloc(sizeof(struct fileinfo) * 
-					     cl->nr_files);
-			continue;
-		}
-		assert(i < cl->nr_files);
-		fi = &cl->fileset[i];
-		fi->name = Malloc(n + 1);
-		sscanf(buf, "%s %u %d", fi->name, &fi->csum, &fi->len);
-		i++;
-	}
-	Rio_destroy(rio);
-	SYS(close(fd));
+	if (strcmp(name, "uniform") == 0)
+		return DIST_UNIFORM;
+	if (strcmp(name, "zipf") == 0)
+		return DIST_ZIPF;
+	if (strcmp(name, "selfsim") == 0)
+		return DIST_SELF_SIMILAR;
+	if (strcmp(name, "hotset") == 0)
+		return DIST_HOT_SET;
+	fprintf(stderr, "unknown distribution: %s\n", name);
+	usage(program);
+	return DIST_UNIFORM;
 }
 
 int
 main(int argc, char *argv[])
 {
 	int i;
+	char c;
 	char *filename;
+	const char *args[5];
 	pthread_t *threads;
 	struct client cl;
 	struct timeval start, end, diff;
+	int timing_mode = 0;
+	int nr_loops = 0;
+	char *dist = "uniform";
+
+	cl.zipf_s = 1.0;
+	cl.self_similar_a = 0.2;
+	cl.hot_frac = 0.1;
+	cl.hot_prob = 0.9;
+	cl.hot_shift = 0;
+	cl.seed = -1;
+	cl.nr_seeded = 0;
+	cl.nr_shed = 0;
+	cl.revalidate = 0;
+	cl.nr_not_modified = 0;
+	cl.nr_ranges = 0;
+	cl.nr_partial = 0;
+	cl.gzip = 0;
+	cl.nr_compressed = 0;
+	cl.depth = 0;
+	cl.unix_path = NULL;
+	cl.nr_connections = 0;
+
+	struct poptOption options_table[] = {
+		{NULL, 't', POPT_ARG_NONE, &timing_mode, 0,
+		 "timing mode, only print the run time", NULL},
+		{NULL, 'd', POPT_ARG_STRING, &dist, 0,
+		 "request distribution: uniform, zipf, selfsim or hotset",
+		 " default: uniform"},
+		{NULL, 'a', POPT_ARG_DOUBLE, &cl.zipf_s, 0,
+		 "zipf exponent", " default: 1.0"},
+		{NULL, 'f', POPT_ARG_DOUBLE, &cl.self_similar_a, 0,
+		 "self similar: fraction of files getting 1 - f of requests",
+		 " default: 0.2"},
+		{NULL, 'H', POPT_ARG_DOUBLE, &cl.hot_frac, 0,
+		 "hot set: fraction of files in the hot set", " default: 0.1"},
+		{NULL, 'P', POPT_ARG_DOUBLE, &cl.hot_prob, 0,
+		 "hot set: probability of requesting a hot file",
+		 " default: 0.9"},
+		{NULL, 'S', POPT_ARG_INT, &cl.hot_shift, 0,
+		 "hot set: move the hot set every S requests per thread",
+		 " default: 0 (never)"},
+		{NULL, 'e', POPT_ARG_INT, &nr_loops, 0,
+		 "use non-blocking connections driven by e event loop "
+		 "threads, nr_threads is then the nr of connections",
+		 " default: 0 (one blocking thread per connection)"},
+		{NULL, 's', POPT_ARG_INT, &cl.seed, 0,
+		 "seed for choosing files, for repeatable runs",
+		 " default: random"},
+		{NULL, 'r', POPT_ARG_NONE, &cl.revalidate, 0,
+		 "revalidate: send If-None-Match for files received before, "
+		 "so that the server can answer with a 304", NULL},
+		{NULL, 'g', POPT_ARG_INT, &cl.nr_ranges, 0,
+		 "ask for each file in this many ranges that cover it, and "
+		 "check that the parts add up to the file",
+		 " default: 0 (whole files)"},
+		{NULL, 'z', POPT_ARG_NONE, &cl.gzip, 0,
+		 "accept gzip encoded files, and check them once inflated",
+		 NULL},
+		{NULL, 'p', POPT_ARG_INT, &cl.depth, 0,
+		 "pipeline: send this many HTTP/1.1 requests on a persistent "
+		 "connection before reading their responses",
+		 " default: 0 (one HTTP/1.0 request per connection)"},
+		{NULL, 'u', POPT_ARG_STRING, &cl.unix_path, 0,
+		 "connect to the server's unix domain socket at this path, "
+		 "host and port are then ignored", " default: tcp"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, (const char **)argv,
+				 options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	for (i = 0; i < 5; i++) {
+		if ((args[i] = poptGetArg(context)) == NULL)
+			usage(argv[0]);
+	}
+	if (poptGetArg(context) != NULL)
+		usage(argv[0]);
 
-	if (argc != 6 && argc != 7) {
+	cl.timing_mode = timing_mode;
+	cl.host = (char *)args[0];
+	cl.port = atoi(args[1]);
+	cl.nr_times = atoi(args[2]);
+	cl.nr_threads = atoi(args[3]);
+	filename = (char *)args[4];
+	if ((cl.port < 1024 && !cl.unix_path) || cl.nr_times <= 0 ||
+	    cl.nr_threads <= 0) {
 		usage(argv[0]);
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
-	}
-	cl.host = argv[i++];
-	cl.port = atoi(argv[i++]);
-	cl.nr_times = atoi(argv[i++]);
-	cl.nr_threads = atoi(argv[i++]);
-	cl.nr_files = 0;
-	filename = argv[i++];
-	if (cl.port < 1024 || cl.nr_times <= 0 || cl.nr_threads <= 0) {
+	cl.nr_loops = nr_loops;
+	if (cl.nr_loops < 0) {
+		fprintf(stderr, "nr of event loops should be >= 0\n");
+		usage(argv[0]);
+	}
+	if (cl.depth < 0 || (cl.depth > 0 && cl.nr_loops > 0)) {
+		fprintf(stderr, "pipelining depth should be >= 0, and needs "
+			"the threaded client\n");
+		usage(argv[0]);
+	}
+	if (cl.nr_ranges < 0 || cl.nr_ranges > 16) {
+		fprintf(stderr, "nr of ranges should be between 0 and 16\n");
+		usage(argv[0]);
+	}
+	cl.dist = parse_dist(argv[0], dist);
+	if (cl.zipf_s <= 0 || cl.self_similar_a <= 0 ||
+	    cl.self_similar_a >= 1 || cl.hot_frac <= 0 || cl.hot_frac > 1 ||
+	    cl.hot_prob < 0 || cl.hot_prob > 1 || cl.hot_shift < 0) {
+		fprintf(stderr, "distribution parameter is out of bounds\n");
 		usage(argv[0]);
 	}
 
-	init_fileset(filename, &cl);
+	/* filename is a text or binary index of the files to be requested */
+	cl.fileset = fileidx_open(filename);
+	cl.nr_files = fileidx_nr_files(cl.fileset);
+	if (cl.revalidate) {
+		cl.etags = calloc(cl.nr_files, ETAG_LEN);
+		if (!cl.etags)
+			unix_error("calloc");
+		pthread_mutex_init(&cl.etag_lock, NULL);
+	}
 
 	if (cl.timing_mode)
 		gettimeofday(&start, NULL);
 
-	init_random();
-
-	threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
-	for (i = 0; i < cl.nr_threads; i++) {
-		SYS(pthread_create(&threads[i], NULL, client_request,
-				   (void *)&cl));
-	}
-	for (i = 0; i < cl.nr_threads; i++) {
-		pthread_join(threads[i], NULL);
+	if (cl.nr_loops > 0) {
+		client_epoll_run(&cl);
+	} else {
+		threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
+		for (i = 0; i < cl.nr_threads; i++) {
+			SYS(pthread_create(&threads[i], NULL,
+					   cl.depth > 0 ? client_pipeline :
+					   client_request, (void *)&cl));
+		}
+		for (i = 0; i < cl.nr_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
 	}
 
 	if (cl.timing_mode) {
@@ -218,5 +695,25 @@ main(int argc, char *argv[])
 		printf("client runtime = %.6f seconds\n",
 			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
 	}
+	if (cl.nr_shed > 0) {
+		printf("client shed = %d of %d requests\n", cl.nr_shed,
+		       cl.nr_times * cl.nr_threads);
+	}
+	if (cl.depth > 0) {
+		printf("client connections = %d for %d requests\n",
+		       cl.nr_connections, cl.nr_times * cl.nr_threads);
+	}
+	if (cl.nr_ranges > 0) {
+		printf("client partial = %d of %d requests\n", cl.nr_partial,
+		       cl.nr_times * cl.nr_threads);
+	}
+	if (cl.gzip) {
+		printf("client compressed = %d of %d requests\n",
+		       cl.nr_compressed, cl.nr_times * cl.nr_threads);
+	}
+	if (cl.revalidate) {
+		printf("client not modified = %d of %d requests\n",
+		       cl.nr_not_modified, cl.nr_times * cl.nr_threads);
+	}
 	exit(0);
 }
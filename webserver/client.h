@@ -0,0 +1,90 @@
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+/* status of the response sent by an overloaded server */
+#define HTTP_SHED 503
+/* status of the response to a revalidation, when the file hasn't changed */
+#define HTTP_NOT_MODIFIED 304
+/* status of the response with the ranges of a file that were asked for */
+#define HTTP_PARTIAL 206
+#define ETAG_LEN 64
+#define BOUNDARY_LEN 72
+
+/* distributions used to pick the next file to request */
+enum dist {
+	DIST_UNIFORM,	/* all files are equally popular */
+	DIST_ZIPF,	/* file k is requested with probability ~ 1 / k^s */
+	DIST_SELF_SIMILAR,	/* e.g., 80% of requests go to 20% of files */
+	DIST_HOT_SET,	/* a hot set of files that shifts over time */
+};
+
+struct client {
+	char *host;
+	int port;
+	char *unix_path;	/* connect to this unix domain socket instead
+				 * of host and port, NULL for tcp */
+	int nr_times;
+	int nr_threads;
+	struct fileidx *fileset;
+	int nr_files;
+	int timing_mode;
+	enum dist dist;
+	double zipf_s;		/* zipf exponent */
+	double self_similar_a;	/* fraction of files that are popular */
+	double hot_frac;	/* fraction of files in the hot set */
+	double hot_prob;	/* probability that a request goes to hot set */
+	int hot_shift;		/* nr of requests until hot set moves */
+	int nr_loops;		/* nr of event loop threads, 0 to use one
+				 * blocking thread per connection */
+	int seed;		/* base seed, or -1 for a random seed */
+	int nr_seeded;		/* nr of threads that have been seeded */
+	int nr_shed;		/* nr of requests shed by the server */
+	int revalidate;		/* send If-None-Match for files received before */
+	char (*etags)[ETAG_LEN];	/* ETag of each file, "" if not received */
+	pthread_mutex_t etag_lock;
+	int nr_not_modified;	/* nr of 304 responses */
+	int nr_ranges;		/* ask for each file in this many ranges */
+	int nr_partial;		/* nr of 206 responses */
+	int gzip;		/* send Accept-Encoding: gzip */
+	int nr_compressed;	/* nr of gzip encoded responses */
+	int depth;		/* send this many requests on a connection
+				 * before reading the responses, 0 for one
+				 * request per connection */
+	int nr_connections;	/* nr of connections opened for pipelining */
+};
+
+/* a response, as it is read */
+struct response {
+	int status;
+	int length;		/* from the header */
+	unsigned int csum;
+	char etag[ETAG_LEN];
+	long range_first;	/* Content-Range of a single range, or -1 */
+	long range_last;
+	long range_size;
+	char boundary[BOUNDARY_LEN];	/* of a multipart body, or "" */
+	int gzip;		/* the body is gzip encoded */
+	int close;		/* the server closes the connection after it */
+	int length_received;
+	unsigned int csum_received;
+	char *body;		/* the body, kept to check the parts of a
+				 * multipart response, or to inflate it */
+	int body_max;
+};
+
+int client_connect(struct client *cl);
+void client_seed_thread(struct client *cl);
+int client_pick_file(struct client *cl, int nr);
+int client_request_line(struct client *cl, int fnr, char *buf, size_t max);
+void client_check(unsigned int orig_csum, int orig_length,
+		  unsigned int csum, int length,
+		  unsigned int csum_received, int length_received);
+void client_response_init(struct response *resp);
+void client_header(struct response *resp, char *line);
+void client_body(struct response *resp, char *buf, int n);
+void client_done(struct client *cl, int fnr, struct response *resp);
+
+/* client_epoll.c */
+void client_epoll_run(struct client *cl);
+
+#endif /* __CLIENT_H__ */
@@ -0,0 +1,307 @@
+/*
+ * client_epoll.c: An event driven engine for the client.
+ *
+ * The threaded client needs one thread per concurrent connection. Here, a few
+ * event loop threads each drive many non-blocking connections using epoll, so
+ * that thousands of concurrent connections can be simulated from one machine.
+ * Each connection makes nr_times requests, one after the other, and each
+ * response is verified in the same way as the threaded client does it.
+ */
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "common.h"
+#include "fileidx.h"
+#include "client.h"
+
+#define EPOLL_EVENTS 256
+
+enum conn_state {
+	CONN_CONNECTING,	/* waiting for non-blocking connect */
+	CONN_SENDING,		/* sending the request */
+	CONN_HEADER,		/* reading the response header */
+	CONN_BODY,		/* reading the response body */
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	int nr_done;		/* nr of requests completed */
+	int fnr;		/* index of the file being requested */
+	char req[MAXLINE];	/* the request */
+	int req_len;
+	int req_sent;
+	char hdr[MAXBUF];	/* the response header read so far */
+	int hdr_len;
+	struct response resp;
+};
+
+struct loop {
+	struct client *cl;
+	struct sockaddr_in serveraddr;
+	int epfd;
+	struct conn *conns;
+	int nr_conns;
+	int nr_active;		/* nr of connections with requests left */
+};
+
+static void
+conn_fail(struct conn *c, char *msg)
+{
+	fprintf(stderr, "connection %d: %s: %s\n", c->fd, msg,
+		errno ? strerror(errno) : "unexpected response");
+	exit(1);
+}
+
+/* start the next request on this connection, if any */
+static void
+conn_start(struct loop *lp, struct conn *c)
+{
+	struct client *cl = lp->cl;
+	struct epoll_event ev;
+	int ret;
+
+	if (c->nr_done == cl->nr_times) {
+		lp->nr_active--;
+		return;
+	}
+	c->fnr = client_pick_file(cl, c->nr_done);
+	c->req_len = client_request_line(cl, c->fnr, c->req, sizeof(c->req));
+	c->req_sent = 0;
+	c->hdr_len = 0;
+	client_response_init(&c->resp);
+
+	if (cl->unix_path) {
+		/* a local connect completes at once, or waits only for the
+		 * server's backlog */
+		c->fd = client_connect(cl);
+		SYS(fcntl(c->fd, F_SETFL, O_NONBLOCK));
+		ret = 0;
+	} else {
+		SYS(c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+		ret = connect(c->fd, (struct sockaddr *)&lp->serveraddr,
+			      sizeof(lp->serveraddr));
+		if (ret < 0 && errno != EINPROGRESS)
+			conn_fail(c, "connect");
+	}
+	c->state = (ret == 0) ? CONN_SENDING : CONN_CONNECTING;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = c;
+	SYS(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, c->fd, &ev));
+}
+
+/* the response is complete */
+static void
+conn_done(struct loop *lp, struct conn *c)
+{
+	client_done(lp->cl, c->fnr, &c->resp);
+	/* closing the fd also removes it from the epoll set */
+	SYS(close(c->fd));
+	c->nr_done++;
+	conn_start(lp, c);
+}
+
+static void
+conn_body(struct loop *lp, struct conn *c, char *buf, int n)
+{
+	if (!lp->cl->timing_mode) {
+		Rio_write(STDOUT_FILENO, buf, n);
+	}
+	client_body(&c->resp, buf, n);
+}
+
+/* parse the header lines, looking for the same tags as client_print() */
+static void
+conn_header(struct loop *lp, struct conn *c, int hdr_end)
+{
+	char line[MAXBUF];
+	char *p = c->hdr;
+	char *next;
+
+	c->hdr[hdr_end] = 0;
+	while (*p) {
+		next = strstr(p, "\r\n");
+		next = next ? next + 2 : p + strlen(p);
+		/* each line is parsed on its own */
+		memcpy(line, p, next - p);
+		line[next - p] = 0;
+		if (!lp->cl->timing_mode) {
+			printf("Header: %s", line);
+		}
+		client_header(&c->resp, line);
+		p = next;
+	}
+	fflush(stdout);
+}
+
+static void
+conn_event(struct loop *lp, struct conn *c)
+{
+	struct epoll_event ev;
+	char buf[MAXBUF];
+	char *end;
+	int err;
+	socklen_t len;
+	ssize_t n;
+
+	switch (c->state) {
+	case CONN_CONNECTING:
+		len = sizeof(err);
+		SYS(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len));
+		if (err) {
+			errno = err;
+			conn_fail(c, "connect");
+		}
+		c->state = CONN_SENDING;
+		/* fall through */
+	case CONN_SENDING:
+		while (c->req_sent < c->req_len) {
+			n = write(c->fd, c->req + c->req_sent,
+				  c->req_len - c->req_sent);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					return;
+				conn_fail(c, "write");
+			}
+			c->req_sent += n;
+		}
+		c->state = CONN_HEADER;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		SYS(epoll_ctl(lp->epfd, EPOLL_CTL_MOD, c->fd, &ev));
+		return;
+	case CONN_HEADER:
+		n = read(c->fd, c->hdr + c->hdr_len,
+			 sizeof(c->hdr) - 1 - c->hdr_len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			conn_fail(c, "read");
+		}
+		if (n == 0) {
+			errno = 0;
+			conn_fail(c, "connection closed in header");
+		}
+		c->hdr_len += n;
+		c->hdr[c->hdr_len] = 0;
+		end = strstr(c->hdr, "\r\n\r\n");
+		if (!end) {
+			if (c->hdr_len == sizeof(c->hdr) - 1) {
+				errno = 0;
+				conn_fail(c, "header is too long");
+			}
+			return;
+		}
+		end += 4;
+		c->state = CONN_BODY;
+		/* save the start of the body, since parsing the header
+		 * terminates it */
+		n = c->hdr + c->hdr_len - end;
+		memcpy(buf, end, n);
+		conn_header(lp, c, end - c->hdr - 2);
+		if (n > 0)
+			conn_body(lp, c, buf, n);
+		return;
+	case CONN_BODY:
+		n = read(c->fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			conn_fail(c, "read");
+		}
+		if (n == 0) {
+			conn_done(lp, c);
+			return;
+		}
+		conn_body(lp, c, buf, n);
+		return;
+	}
+}
+
+static void *
+client_loop(void *arg)
+{
+	struct loop *lp = (struct loop *)arg;
+	struct epoll_event events[EPOLL_EVENTS];
+	int i, n;
+
+	/* the connections of this loop share its generator, so with a fixed
+	 * seed, the files requested by each connection depend on the order in
+	 * which the responses arrive */
+	client_seed_thread(lp->cl);
+	SYS(lp->epfd = epoll_create1(0));
+	lp->nr_active = lp->nr_conns;
+	for (i = 0; i < lp->nr_conns; i++) {
+		lp->conns[i].nr_done = 0;
+		conn_start(lp, &lp->conns[i]);
+	}
+	while (lp->nr_active > 0) {
+		n = epoll_wait(lp->epfd, events, EPOLL_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		for (i = 0; i < n; i++) {
+			conn_event(lp, events[i].data.ptr);
+		}
+	}
+	SYS(close(lp->epfd));
+	return NULL;
+}
+
+/* each connection needs a file descriptor, so allow as many as possible */
+static void
+raise_fd_limit(int nr_conns)
+{
+	struct rlimit rl;
+
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		SYS(setrlimit(RLIMIT_NOFILE, &rl));
+	}
+	if (rl.rlim_cur < nr_conns + 16) {
+		fprintf(stderr, "warning: open file limit %ld is too small "
+			"for %d connections\n", (long)rl.rlim_cur, nr_conns);
+	}
+}
+
+/* run cl->nr_threads connections on cl->nr_loops event loop threads */
+void
+client_epoll_run(struct client *cl)
+{
+	struct sockaddr_in serveraddr;
+	struct loop *loops;
+	pthread_t *threads;
+	int nr_loops = cl->nr_loops;
+	int i, nr_conns = 0;
+
+	if (nr_loops > cl->nr_threads)
+		nr_loops = cl->nr_threads;
+	raise_fd_limit(cl->nr_threads);
+	/* resolve the server once, instead of on each connect. it isn't
+	 * used with a unix domain socket */
+	memset(&serveraddr, 0, sizeof(serveraddr));
+	if (!cl->unix_path)
+		resolve_host(cl->host, cl->port, &serveraddr);
+
+	loops = Malloc(sizeof(struct loop) * nr_loops);
+	threads = Malloc(sizeof(pthread_t) * nr_loops);
+	for (i = 0; i < nr_loops; i++) {
+		struct loop *lp = &loops[i];
+
+		lp->cl = cl;
+		lp->serveraddr = serveraddr;
+		lp->nr_conns = cl->nr_threads / nr_loops +
+			(i < cl->nr_threads % nr_loops);
+		lp->conns = Malloc(sizeof(struct conn) * lp->nr_conns);
+		nr_conns += lp->nr_conns;
+		SYS(pthread_create(&threads[i], NULL, client_loop, lp));
+	}
+	assert(nr_conns == cl->nr_threads);
+	for (i = 0; i < nr_loops; i++) {
+		pthread_join(threads[i], NULL);
+		free(loops[i].conns);
+	}
+	free(threads);
+	free(loops);
+}
@@ -103,6 +103,39 @@ rio_write(int fd, void *usrbuf, size_t n)
 	return n;
 }
 
+/* rio_writev - robustly write all the buffers in iov (unbuffered), with as few
+ * system calls as possible. iov is updated as it is written. */
+static ssize_t
+rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	size_t n = 0;
+	ssize_t nwritten;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+	while (iovcnt > 0) {
+		if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				nwritten = 0;	/* and call writev() again */
+			else
+				return -1;	/* errorno set by writev() */
+		}
+		/* skip the buffers that were written, then the written part of
+		 * the first remaining one */
+		while (iovcnt > 0 && nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return n;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -145,7 +178,8 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	int n, rc;
 	char c, *bufp = usrbuf;
 
-	for (n = 0; n < maxlen; n++) {
+	/* leave room for the terminating null */
+	for (n = 0; n < maxlen - 1; n++) {
 		if ((rc = rio_readb(rp, &c, 1)) == 1) {
 			*bufp++ = c;
 			if (c == '\n') {
@@ -184,6 +218,13 @@ Rio_write(int fd, void *usrbuf, size_t n)
 		unix_error("Rio_writen error");
 }
 
+void
+Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	if (rio_writev(fd, iov, iovcnt) < 0)
+		unix_error("Rio_writev error");
+}
+
 struct rio *
 Rio_init(int fd)
 {
@@ -209,23 +250,36 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 	return rc;
 }
 
+/* read up to n bytes, from the buffer if it has any. returns 0 at EOF */
+ssize_t
+Rio_readb(struct rio *rp, void *usrbuf, size_t n)
+{
+	ssize_t rc;
+
+	if ((rc = rio_readb(rp, usrbuf, n)) < 0)
+		unix_error("Rio_readb error");
+	return rc;
+}
+
+/* the nr of bytes that were read from the descriptor, but not consumed */
+int
+Rio_buffered(struct rio *rp)
+{
+	return rp->rio_cnt;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
-/* open connection to server at <hostname, port> and return a socket descriptor
- * ready for reading and writing. */
-int
-open_clientfd(char *hostname, int port)
+/* fill serveraddr with the address of the server at <hostname, port> */
+void
+resolve_host(char *hostname, int port, struct sockaddr_in *serveraddr)
 {
-	int clientfd;
 	struct hostent *hp;
 	struct hostent hent;
 	size_t buf_len;
 	char* buf;
 	int rc, h_errno_local;
-	struct sockaddr_in serveraddr;
-
-	SYS(clientfd = socket(AF_INET, SOCK_STREAM, 0));
 
 	/* Fill in the server's IP address and port */
 	/* Loop is necessary to grow buffer if it's currently not big enough for
@@ -252,14 +306,26 @@ open_clientfd(char *hostname, int port)
 		exit(1);
 	}
 
-	bzero((char *)&serveraddr, sizeof(serveraddr));
-	serveraddr.sin_family = AF_INET;
+	bzero((char *)serveraddr, sizeof(*serveraddr));
+	serveraddr->sin_family = AF_INET;
 	bcopy((char *)hp->h_addr,
-	      (char *)&serveraddr.sin_addr.s_addr, hp->h_length);
+	      (char *)&serveraddr->sin_addr.s_addr, hp->h_length);
 	/* Documentation makes no mention of when buf is safe to be freed,
 	 * but it should be safe to free now since we're done with hp. */
 	free(buf);
-	serveraddr.sin_port = htons(port);
+	serveraddr->sin_port = htons(port);
+}
+
+/* open connection to server at <hostname, port> and return a socket descriptor
+ * ready for reading and writing. */
+int
+open_clientfd(char *hostname, int port)
+{
+	int clientfd;
+	struct sockaddr_in serveraddr;
+
+	SYS(clientfd = socket(AF_INET, SOCK_STREAM, 0));
+	resolve_host(hostname, port, &serveraddr);
 
 	/* Establish a connection with the server */
 	SYS(connect(clientfd, (struct sockaddr *)&serveraddr,
@@ -295,17 +361,121 @@ open_listenfd(int port)
 	return listenfd;
 }
 
+/* fill addr with the address of the unix domain socket at path, returns its
+ * length */
+static socklen_t
+unix_addr(char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "%s: socket path is too long\n", path);
+		exit(1);
+	}
+	bzero((char *)addr, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return sizeof(*addr);
+}
+
+/* open a connection to the server listening on the unix domain socket at
+ * path */
+int
+open_unix_clientfd(char *path)
+{
+	int clientfd;
+	struct sockaddr_un serveraddr;
+	socklen_t len = unix_addr(path, &serveraddr);
+
+	SYS(clientfd = socket(AF_UNIX, SOCK_STREAM, 0));
+	SYS(connect(clientfd, (struct sockaddr *)&serveraddr, len));
+	return clientfd;
+}
+
+/* open and return a listening unix domain socket at path. a socket left
+ * there by an earlier server is removed first. */
+int
+open_unix_listenfd(char *path)
+{
+	int listenfd;
+	struct sockaddr_un serveraddr;
+	socklen_t len = unix_addr(path, &serveraddr);
+
+	SYS(listenfd = socket(AF_UNIX, SOCK_STREAM, 0));
+	if (unlink(path) < 0 && errno != ENOENT)
+		unix_error("unlink");
+	SYS(bind(listenfd, (struct sockaddr *)&serveraddr, len));
+	SYS(listen(listenfd, LISTENQ));
+	return listenfd;
+}
+
 /*********************************************************
  * Functions for generating long-tail random distributions
  *********************************************************/
 
-#define RAND ((double)random())/RAND_MAX
+/*
+ * Each thread has its own generator, so that threads don't serialize on the
+ * lock that random() takes on every call. By default, the generator is
+ * xoshiro256**, seeded through splitmix64. init_random_compat() instead
+ * produces exactly the same stream as srandom() and random() do, using the
+ * reentrant random_r().
+ *
+ * All the distribution functions below use the generator through RAND, so
+ * they return the same values when given the same stream.
+ */
+
+enum rand_kind {
+	RAND_UNSEEDED,
+	RAND_XOSHIRO,
+	RAND_GLIBC,
+};
+
+struct rand_state {
+	enum rand_kind kind;
+	uint64_t s[4];		/* xoshiro256** state */
+	struct random_data rd;	/* random_r() state */
+	char rd_buf[128];	/* same state size as random() uses */
+};
+
+static __thread struct rand_state rand_state;
+
+#define RAND ((double)rand_next())/RAND_MAX
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t
+rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
 
+static uint64_t
+xoshiro256ss(uint64_t *s)
+{
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* seed the calling thread's generator from /dev/urandom */
 void
 init_random()
 {
 	int fd = open("/dev/urandom", O_RDONLY);
-	int seed;
+	unsigned int seed;
 
 	if (fd < 0) {
 		fprintf(stderr, "couldn't open /dev/random\n");
@@ -315,7 +485,54 @@ init_random()
 		fprintf(stderr, "couldn't read /dev/random\n");
 		exit(1);
 	}
-	srandom(seed);
+	close(fd);
+	init_random_seed(seed);
+}
+
+/* seed the calling thread's generator with a fixed value so that a run can be
+ * repeated */
+void
+init_random_seed(unsigned int seed)
+{
+	uint64_t x = seed;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		rand_state.s[i] = splitmix64(&x);
+	}
+	rand_state.kind = RAND_XOSHIRO;
+}
+
+/* seed the calling thread's generator so that it returns the same values as
+ * random() does after srandom(seed) */
+void
+init_random_compat(unsigned int seed)
+{
+	/* initstate_r() requires rd.state to be NULL */
+	memset(&rand_state.rd, 0, sizeof(rand_state.rd));
+	SYS(initstate_r(seed, rand_state.rd_buf, sizeof(rand_state.rd_buf),
+			&rand_state.rd));
+	rand_state.kind = RAND_GLIBC;
+}
+
+/* return value: >= 0 and <= RAND_MAX, like random() */
+long
+rand_next()
+{
+	int32_t r;
+
+	switch (rand_state.kind) {
+	case RAND_GLIBC:
+		random_r(&rand_state.rd, &r);
+		return r;
+	case RAND_UNSEEDED:
+		init_random();
+		/* fall through */
+	case RAND_XOSHIRO:
+	default:
+		/* the high bits are the best ones */
+		return xoshiro256ss(rand_state.s) >> 33;
+	}
 }
 
 /* return value: >= 1 and <= high */
@@ -380,3 +597,83 @@ rand_self_similar_int(double a, int high)
 	assert(ret >= 1 && ret <= high);
 	return ret;
 }
+
+/*
+ * Input: s > 0 
+ * Return value: >= 1 and <= high
+ *
+ * Returns k with probability proportional to 1 / k^s, so that value 1 is the
+ * most popular, value 2 is the next most popular, and so on. Larger values of
+ * s make the distribution more skewed.
+ *
+ * We use rejection-inversion sampling, so no table of size high is needed.
+ * Obtained from: Hormann and Derflinger, "Rejection-inversion to generate
+ * variates from monotone discrete distributions", ACM TOMACS, 1996.
+ */
+
+/* log(1 + x) / x, accurate for small x */
+static double
+zipf_helper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+/* (exp(x) - 1) / x, accurate for small x */
+static double
+zipf_helper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x * 1.0 / 3 * (1 + 0.25 * x));
+}
+
+/* h(x) = 1 / x^s */
+static double
+zipf_h(double s, double x)
+{
+	return exp(-s * log(x));
+}
+
+/* H(x), the integral of h(x) */
+static double
+zipf_H(double s, double x)
+{
+	double log_x = log(x);
+	return zipf_helper2((1 - s) * log_x) * log_x;
+}
+
+/* inverse of H(x) */
+static double
+zipf_H_inv(double s, double x)
+{
+	double t = x * (1 - s);
+
+	if (t < -1)
+		t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+int
+rand_zipf_int(double s, int high)
+{
+	double H_x1, H_n, cutoff;
+
+	assert(s > 0 && high >= 1);
+	H_x1 = zipf_H(s, 1.5) - 1;
+	H_n = zipf_H(s, high + 0.5);
+	cutoff = 2 - zipf_H_inv(s, zipf_H(s, 2.5) - zipf_h(s, 2));
+	while (1) {
+		double u = H_n + RAND * (H_x1 - H_n);
+		double x = zipf_H_inv(s, u);
+		int k = (int)(x + 0.5);
+
+		if (k < 1)
+			k = 1;
+		else if (k > high)
+			k = high;
+		if (k - x <= cutoff || u >= zipf_H(s, k + 0.5) - zipf_h(s, k))
+			return k;
+	}
+}
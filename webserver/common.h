@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
@@ -15,11 +16,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -62,6 +65,9 @@
 #define MAXBUF   8192	/* max I/O buffer size */
 #define LISTENQ  1024	/* second argument to listen() */
 
+/* Error-handling functions */
+void unix_error(char *msg);
+
 /* Memory managment wrappers */
 void *Malloc(size_t size);
 
@@ -72,18 +78,28 @@ struct rio *Rio_init(int fd);
 void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readb(struct rio *rp, void *usrbuf, size_t n);
+int Rio_buffered(struct rio *rp);
 
 /* Wrappers for client/server helper functions */
+void resolve_host(char *hostname, int port, struct sockaddr_in *serveraddr);
 int open_clientfd(char *hostname, int port);
 int open_listenfd(int port);
+int open_unix_clientfd(char *path);
+int open_unix_listenfd(char *path);
 
 /* Random functions */
 void init_random();
+void init_random_seed(unsigned int seed);
+void init_random_compat(unsigned int seed);
+long rand_next();
 int rand_int(int high);
 double rand_pareto(double m, double a);
 int rand_pareto_int(double m, double a);
 double rand_self_similar(double a);
 int rand_self_similar_int(double a, int high);
+int rand_zipf_int(double s, int high);
 
 #endif /* __CSAPP_H__ */
@@ -0,0 +1,251 @@
+/*
+ * fileidx.c: Reading and writing the index of a file set.
+ *
+ * See fileidx.h for the text and binary formats.
+ */
+
+#include "common.h"
+#include "fileidx.h"
+
+struct fileidx {
+	int nr_files;
+	struct fileidx_record *records;
+	char *strtab;
+	uint64_t strtab_size;
+	void *map;		/* the mapped binary index, NULL for text */
+	size_t map_size;
+};
+
+struct fileidx_writer {
+	char *filename;
+	FILE *records;		/* writes the header and the records */
+	FILE *names;		/* writes the name table */
+	int nr_files;
+	int nr_added;
+	uint64_t strtab_size;
+	uint64_t name_offset;	/* offset of the next name */
+};
+
+static void
+fileidx_error(char *filename, char *msg)
+{
+	fprintf(stderr, "%s: %s\n", filename, msg);
+	exit(1);
+}
+
+/* map a binary index. only the header is checked, so that this takes the same
+ * time for any number of files. */
+static void
+fileidx_map(struct fileidx *idx, char *filename, int fd, size_t size)
+{
+	struct fileidx_header *hdr;
+
+	idx->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (idx->map == MAP_FAILED)
+		unix_error("mmap");
+	idx->map_size = size;
+	hdr = idx->map;
+	if (hdr->version != FILEIDX_VERSION ||
+	    hdr->record_size != sizeof(struct fileidx_record))
+		fileidx_error(filename, "unsupported index version");
+	if (hdr->nr_files == 0 || hdr->nr_files > INT32_MAX ||
+	    hdr->strtab_offset < sizeof(*hdr) +
+	    hdr->nr_files * sizeof(struct fileidx_record) ||
+	    hdr->strtab_offset > size ||
+	    hdr->strtab_size > size - hdr->strtab_offset)
+		fileidx_error(filename, "index is corrupt");
+	idx->nr_files = hdr->nr_files;
+	idx->records = (struct fileidx_record *)(hdr + 1);
+	idx->strtab = (char *)idx->map + hdr->strtab_offset;
+	idx->strtab_size = hdr->strtab_size;
+}
+
+/* parse a text index into the same layout as the binary index */
+static void
+fileidx_parse(struct fileidx *idx, char *filename, int fd)
+{
+	struct rio *rio;
+	char buf[MAXLINE];
+	char *name;
+	unsigned int csum;
+	long size;
+	uint64_t max_strtab = MAXLINE;
+	int i = 0, n;
+
+	idx->map = NULL;
+	idx->nr_files = 0;
+	idx->strtab = Malloc(max_strtab);
+	idx->strtab_size = 0;
+	name = Malloc(MAXLINE);
+	rio = Rio_init(fd);
+	while (1) {
+		struct fileidx_record *rec;
+		n = Rio_readlineb(rio, buf, MAXLINE);
+		if (n == 0) {
+			assert(idx->nr_files > 0);
+			assert(i == idx->nr_files);
+			break;
+		}
+		if (idx->nr_files == 0) {
+			idx->nr_files = atoi(buf);
+			assert(idx->nr_files > 0);
+			idx->records = Malloc(sizeof(struct fileidx_record) *
+					      idx->nr_files);
+			continue;
+		}
+		assert(i < idx->nr_files);
+		if (sscanf(buf, "%s %u %ld", name, &csum, &size) != 3)
+			fileidx_error(filename, "index is corrupt");
+		rec = &idx->records[i];
+		rec->name_offset = idx->strtab_size;
+		rec->name_len = strlen(name);
+		rec->csum = csum;
+		rec->size = size;
+		if (idx->strtab_size + rec->name_len + 1 > max_strtab) {
+			max_strtab *= 2;
+			idx->strtab = realloc(idx->strtab, max_strtab);
+			if (!idx->strtab)
+				unix_error("realloc");
+		}
+		memcpy(idx->strtab + idx->strtab_size, name, rec->name_len + 1);
+		idx->strtab_size += rec->name_len + 1;
+		i++;
+	}
+	Rio_destroy(rio);
+	free(name);
+}
+
+struct fileidx *
+fileidx_open(char *filename)
+{
+	struct fileidx *idx;
+	struct stat sbuf;
+	char magic[sizeof(FILEIDX_MAGIC) - 1];
+	int fd;
+
+	idx = Malloc(sizeof(struct fileidx));
+	SYS(fd = open(filename, O_RDONLY, 0));
+	SYS(fstat(fd, &sbuf));
+	if (sbuf.st_size >= sizeof(struct fileidx_header) &&
+	    Rio_read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	    memcmp(magic, FILEIDX_MAGIC, sizeof(magic)) == 0) {
+		fileidx_map(idx, filename, fd, sbuf.st_size);
+	} else {
+		SYS(lseek(fd, 0, SEEK_SET));
+		fileidx_parse(idx, filename, fd);
+	}
+	SYS(close(fd));
+	return idx;
+}
+
+void
+fileidx_close(struct fileidx *idx)
+{
+	if (idx->map) {
+		SYS(munmap(idx->map, idx->map_size));
+	} else {
+		free(idx->records);
+		free(idx->strtab);
+	}
+	free(idx);
+}
+
+int
+fileidx_nr_files(struct fileidx *idx)
+{
+	return idx->nr_files;
+}
+
+char *
+fileidx_name(struct fileidx *idx, int nr)
+{
+	struct fileidx_record *rec;
+
+	assert(nr >= 0 && nr < idx->nr_files);
+	rec = &idx->records[nr];
+	assert(rec->name_offset + rec->name_len < idx->strtab_size);
+	return idx->strtab + rec->name_offset;
+}
+
+unsigned int
+fileidx_csum(struct fileidx *idx, int nr)
+{
+	assert(nr >= 0 && nr < idx->nr_files);
+	return idx->records[nr].csum;
+}
+
+long
+fileidx_size(struct fileidx *idx, int nr)
+{
+	assert(nr >= 0 && nr < idx->nr_files);
+	return idx->records[nr].size;
+}
+
+/* the header and records are written through one stream, and the names
+ * through another, so that both can be written as the files are added */
+struct fileidx_writer *
+fileidx_create(char *filename, int nr_files, long strtab_size)
+{
+	struct fileidx_writer *w;
+	struct fileidx_header hdr;
+
+	assert(nr_files > 0);
+	w = Malloc(sizeof(struct fileidx_writer));
+	w->filename = strdup(filename);
+	w->nr_files = nr_files;
+	w->nr_added = 0;
+	/* each name is null-terminated */
+	w->strtab_size = strtab_size + nr_files;
+	w->name_offset = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FILEIDX_MAGIC, sizeof(hdr.magic));
+	hdr.version = FILEIDX_VERSION;
+	hdr.record_size = sizeof(struct fileidx_record);
+	hdr.nr_files = nr_files;
+	hdr.strtab_offset = sizeof(hdr) +
+		(uint64_t)nr_files * sizeof(struct fileidx_record);
+	hdr.strtab_size = w->strtab_size;
+
+	if (!(w->records = fopen(filename, "w")))
+		unix_error(filename);
+	if (!(w->names = fopen(filename, "r+")))
+		unix_error(filename);
+	if (fseeko(w->names, hdr.strtab_offset, SEEK_SET) < 0)
+		unix_error(filename);
+	if (fwrite(&hdr, sizeof(hdr), 1, w->records) != 1)
+		unix_error(filename);
+	return w;
+}
+
+void
+fileidx_add(struct fileidx_writer *w, char *name, unsigned int csum,
+	    long size)
+{
+	struct fileidx_record rec;
+
+	assert(w->nr_added < w->nr_files);
+	rec.name_offset = w->name_offset;
+	rec.name_len = strlen(name);
+	rec.csum = csum;
+	rec.size = size;
+	if (w->name_offset + rec.name_len + 1 > w->strtab_size)
+		fileidx_error(w->filename, "names are longer than expected");
+	if (fwrite(&rec, sizeof(rec), 1, w->records) != 1 ||
+	    fwrite(name, rec.name_len + 1, 1, w->names) != 1)
+		unix_error(w->filename);
+	w->name_offset += rec.name_len + 1;
+	w->nr_added++;
+}
+
+void
+fileidx_finish(struct fileidx_writer *w)
+{
+	if (w->nr_added != w->nr_files ||
+	    w->name_offset != w->strtab_size)
+		fileidx_error(w->filename, "fewer files than expected");
+	if (fclose(w->records) != 0 || fclose(w->names) != 0)
+		unix_error(w->filename);
+	free(w->filename);
+	free(w);
+}
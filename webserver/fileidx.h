@@ -0,0 +1,54 @@
+#ifndef __FILEIDX_H__
+#define __FILEIDX_H__
+
+/*
+ * The index of a file set lists the name, checksum and size of each file.
+ *
+ * The text format has the number of files on the first line, followed by one
+ * "name csum size" line per file.
+ *
+ * The binary format can be mapped into memory and used directly, so opening
+ * it takes the same time however many files it lists. It has a header,
+ * followed by one fixed size record per file, followed by a table of the
+ * null-terminated file names. All fields are in host byte order.
+ */
+
+#define FILEIDX_MAGIC "OSFIDX\0\0"
+#define FILEIDX_VERSION 1
+
+struct fileidx_header {
+	char magic[8];		/* FILEIDX_MAGIC */
+	uint32_t version;	/* FILEIDX_VERSION */
+	uint32_t record_size;	/* sizeof(struct fileidx_record) */
+	uint64_t nr_files;
+	uint64_t strtab_offset;	/* offset of the names from start of file */
+	uint64_t strtab_size;
+};
+
+struct fileidx_record {
+	uint64_t name_offset;	/* offset of the name in the name table */
+	uint32_t name_len;	/* not including the null */
+	uint32_t csum;
+	int64_t size;
+};
+
+struct fileidx;
+struct fileidx_writer;
+
+/* opens a text or binary index, exits on failure */
+struct fileidx *fileidx_open(char *filename);
+void fileidx_close(struct fileidx *idx);
+int fileidx_nr_files(struct fileidx *idx);
+char *fileidx_name(struct fileidx *idx, int nr);
+unsigned int fileidx_csum(struct fileidx *idx, int nr);
+long fileidx_size(struct fileidx *idx, int nr);
+
+/* writes a binary index. strtab_size is the total length of all the names,
+ * not including their nulls. */
+struct fileidx_writer *fileidx_create(char *filename, int nr_files,
+				      long strtab_size);
+void fileidx_add(struct fileidx_writer *w, char *name, unsigned int csum,
+		 long size);
+void fileidx_finish(struct fileidx_writer *w);
+
+#endif /* __FILEIDX_H__ */
@@ -6,8 +6,10 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <popt.h>
 #include "common.h"
+#include "fileidx.h"
 
 /* Generate a set of files for the webserver assignment */
 
@@ -26,24 +28,219 @@ usage()
 #define DEFAULT_NR_FILES 256
 /* the directory in which to create the files */
 #define DEFAULT_DIR fileset_dir
+/* the seed used for the file sizes and contents */
+#define DEFAULT_SEED 100
+/* the max nr of files */
+#define MAX_NR_FILES 100000000
+
+/* each thread generates this many files at a time */
+#define FILES_PER_BATCH 64
+/* and writes each file in chunks of this size */
+#define CHUNK_SZ (64 * 1024)
+/* nr of independent generators used to fill a chunk */
+#define LANES 8
 
 static int default_file_sz = DEFAULT_MEAN_FILE_SZ;
 static int default_nr_files = DEFAULT_NR_FILES;
 static char *dir = STR(DEFAULT_DIR);
+static int seed = DEFAULT_SEED;
+static int nr_threads = 0;
+
+/* the file set that is shared by the generator threads */
+struct fileset {
+	int nr_files;
+	int *sizes;
+	unsigned int *csums;
+	int next;		/* next file to be generated */
+};
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Fill buf with printable characters, and return their checksum.
+ *
+ * Each of the LANES xorshift generators fills every LANES'th byte, so that
+ * the compiler can vectorize the loop. The top bits of each value are scaled
+ * to the printable characters between 0x20-0x73.
+ */
+static unsigned int
+fill_printable(unsigned char *buf, int n, uint32_t *state)
+{
+	unsigned int csum = 0;
+	int i, l;
+
+	for (i = 0; i < n; i += LANES) {
+		for (l = 0; l < LANES; l++) {
+			uint32_t x = state[l];
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			state[l] = x;
+			/* buf has room for a full group of lanes */
+			buf[i + l] = 0x20 + (((x >> 16) * (0x73 - 0x20)) >> 16);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		csum += buf[i];
+	}
+	return csum;
+}
+
+static void
+file_name(char *filename, int nr)
+{
+	sprintf(filename, "%s/%05d", dir, nr);
+}
+
+/* write file nr, and return its checksum */
+static unsigned int
+write_file(int nr, int file_sz, unsigned char *buf)
+{
+	char filename[1024];
+	uint32_t state[LANES];
+	uint64_t x = ((uint64_t)seed << 32) ^ nr;
+	unsigned int csum = 0;
+	int fd, l, remaining;
+
+	/* each file has its own generators, so the contents don't depend on
+	 * the nr of threads or the order in which the files are written */
+	for (l = 0; l < LANES; l++) {
+		do {
+			state[l] = splitmix64(&x);
+		} while (state[l] == 0);
+	}
+	file_name(filename, nr);
+	SYS(fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	remaining = file_sz;
+	while (remaining > 0) {
+		int sz = (remaining < CHUNK_SZ) ? remaining : CHUNK_SZ;
+		csum += fill_printable(buf, sz, state);
+		Rio_write(fd, buf, sz);
+		remaining -= sz;
+	}
+	SYS(close(fd));
+	return csum;
+}
+
+static void *
+generate_files(void *arg)
+{
+	struct fileset *fs = (struct fileset *)arg;
+	unsigned char *buf = Malloc(CHUNK_SZ + LANES);
+	int first, nr;
+
+	while ((first = __sync_fetch_and_add(&fs->next, FILES_PER_BATCH)) <
+	       fs->nr_files) {
+		for (nr = first; nr < first + FILES_PER_BATCH &&
+			     nr < fs->nr_files; nr++) {
+			fs->csums[nr] = write_file(nr, fs->sizes[nr], buf);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* remove the regular files in an existing directory, or create it */
+static void
+clean_dir()
+{
+	DIR *d;
+
+	d = opendir(dir);
+	if (d) { /* directory exists */
+		struct dirent *p;
+		while ((p = readdir(d)) != NULL) {
+			char buf[4096];
+			struct stat statbuf;
+			snprintf(buf, sizeof(buf), "%s/%s", dir, p->d_name);
+			/* avoid a stat per file, when we can */
+			if (p->d_type == DT_REG) {
+				unlink(buf);
+			} else if (p->d_type == DT_UNKNOWN &&
+				   stat(buf, &statbuf) >= 0) {
+				if (S_ISREG(statbuf.st_mode)) {
+					unlink(buf);
+				}
+			}
+		}
+		closedir(d);
+	} else {
+		if (mkdir(dir, 0755) < 0) {
+			fprintf(stderr, "mkdir: %s: %s\n", dir,
+				strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+/* write the index one line at a time, instead of building it in memory. the
+ * same index is also written in binary form, to dir.bidx */
+static void
+write_index(struct fileset *fs)
+{
+	char filename[1024];
+	char *iobuf;
+	FILE *idx;
+	struct fileidx_writer *bidx;
+	long strtab_size = 0;
+	int nr;
+
+	for (nr = 0; nr < fs->nr_files; nr++) {
+		file_name(filename, nr);
+		strtab_size += strlen(filename);
+	}
+	strcpy(filename, dir);
+	strcat(filename, ".bidx");
+	bidx = fileidx_create(filename, fs->nr_files, strtab_size);
+
+	strcpy(filename, dir);
+	strcat(filename, ".idx");
+	idx = fopen(filename, "w");
+	if (!idx) {
+		fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	iobuf = Malloc(CHUNK_SZ);
+	setvbuf(idx, iobuf, _IOFBF, CHUNK_SZ);
+
+	/* write the number of files in the index file */
+	fprintf(idx, "%d\n", fs->nr_files);
+
+	for (nr = 0; nr < fs->nr_files; nr++) {
+		file_name(filename, nr);
+		printf("filename = %s, csum = %u, len = %d\n", filename,
+		       fs->csums[nr], fs->sizes[nr]);
+		fprintf(idx, "%s %u %d\n", filename, fs->csums[nr],
+			fs->sizes[nr]);
+		fileidx_add(bidx, filename, fs->csums[nr], fs->sizes[nr]);
+	}
+	fileidx_finish(bidx);
+	if (ferror(idx) || fclose(idx) != 0) {
+		fprintf(stderr, "write: %s.idx: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	free(iobuf);
+}
 
 int
 main(int argc, const char *argv[])
 {
 	char c;
 	int nr_files = 0;
-	DIR *d;
-	char filename[1024];
-	int current_fileset_sz = 0;
-	int total_fileset_sz;
-	int fd_idx;
-	char idx_buf[4096];
-	char idx_buffer[4096 * 256]; // a large buffer
-	int cur_size = 0;
+	int max_files = 0;
+	long long current_fileset_sz = 0;
+	long long total_fileset_sz;
+	struct fileset fs;
+	pthread_t *threads;
+	int i;
 
 	struct poptOption options_table[] = {
 		{NULL, 'm', POPT_ARG_INT, &default_file_sz, 'm',
@@ -55,6 +252,12 @@ main(int argc, const char *argv[])
 		{NULL, 'd', POPT_ARG_STRING, &dir, 'd',
 		 "directory in which the files are created",
 		 " default: " STR(DEFAULT_DIR)},
+		{NULL, 's', POPT_ARG_INT, &seed, 's',
+		 "seed for the file sizes and contents",
+		 " default: " STR(DEFAULT_SEED)},
+		{NULL, 'j', POPT_ARG_INT, &nr_threads, 'j',
+		 "number of threads that write files",
+		 " default: number of cpus"},
 		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
 	};
 
@@ -70,7 +273,7 @@ main(int argc, const char *argv[])
 		fprintf(stderr, "mean file size is too small\n");
 		usage();
 	}
-	if (default_nr_files < 1 || default_nr_files > 99999) {
+	if (default_nr_files < 1 || default_nr_files > MAX_NR_FILES) {
 		fprintf(stderr, "nr of files is out of bounds\n");
 		usage();
 	}
@@ -78,86 +281,68 @@ main(int argc, const char *argv[])
 		fprintf(stderr, "dir name is too long\n");
 		usage();
 	}
-	d = opendir(dir);
-	if (d) { /* directory exists */
-		struct dirent *p;
-		while ((p = readdir(d)) != NULL) {
-			char buf[4096];
-			struct stat statbuf;
-			sprintf(buf, "%s/%s", dir, p->d_name);
-			if (stat(buf, &statbuf) >= 0) {
-				if (S_ISREG(statbuf.st_mode)) {
-					unlink(buf);
-				}
-			}
-		}
-		closedir(d);
-	} else {
-		if (mkdir(dir, 0755) < 0) {
-			fprintf(stderr, "mkdir: %s: %s\n", dir, 
-				strerror(errno));
-			exit(1);
-		}
+	if (nr_threads < 0) {
+		fprintf(stderr, "nr of threads is out of bounds\n");
+		usage();
+	}
+	if (nr_threads == 0) {
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_threads < 1)
+			nr_threads = 1;
 	}
+	clean_dir();
+
 	// fix the seed of the random number generator, or else the file size
 	// distributions vary too much, leading to high variance in results.
 	// note that the client still uses a random seed to request files.
-	// init_random();
-	srandom(100);
-	total_fileset_sz = default_file_sz * 4096 * default_nr_files;
-	/* null terminate the buffer */
-	idx_buffer[0] = 0;
+	// the sizes are drawn serially from the random() stream of the seed,
+	// and the contents in parallel from generators of their own, see
+	// write_file. the contents no longer come from the same stream, so
+	// the sizes differ from those of the old serial loop.
+	init_random_compat(seed);
+	total_fileset_sz = (long long)default_file_sz * 4096 * default_nr_files;
+	/* choose all the file sizes up front, so that the files can be
+	 * generated in parallel */
+	fs.sizes = NULL;
 	while (current_fileset_sz < total_fileset_sz) {
-		char name[10];
-		int fd, file_sz, remaining;
-		char buf[4096];
 		double ms = default_file_sz;
-		unsigned int csum = 0;
-		int j;
+		double file_sz;
 
-		strcpy(filename, dir);
-		sprintf(name, "/%05d", nr_files++);
-		strcat(filename, name);
-		file_sz = rand_pareto(4096, ms/(ms - 1));
-		current_fileset_sz += file_sz;
-		SYS(fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644));
-		remaining = file_sz;
-		while (remaining > 0) {
-			int sz = (remaining < 4096) ? remaining : 4096;
-			for (j = 0; j < sz; j++) {
-				/* printable characters lie between 0x20-0x73 */
-				buf[j] = random() % (0x73 - 0x20) + 0x20;
-				csum += (unsigned char)(buf[j]);
+		if (nr_files == max_files) {
+			max_files = max_files ? max_files * 2 : 1024;
+			fs.sizes = realloc(fs.sizes, sizeof(int) * max_files);
+			if (!fs.sizes) {
+				perror("realloc");
+				exit(1);
 			}
-			Rio_write(fd, buf, sz);
-			remaining -= sz;
 		}
-		SYS(close(fd));
-		printf("filename = %s, csum = %u, len = %d\n", filename, csum,
-		       file_sz);
-		sprintf(idx_buf, "%s %u %d\n", filename, csum, file_sz);
-		cur_size += strlen(idx_buf);
-		/* avoid buffer overflow */
-		assert(cur_size < (4096 * 256 - 1));
-		strcat(idx_buffer, idx_buf);
+		file_sz = rand_pareto(4096, ms/(ms - 1));
+		if (file_sz > INT_MAX)
+			file_sz = INT_MAX;
+		fs.sizes[nr_files++] = file_sz;
+		current_fileset_sz += (int)file_sz;
 	}
+	fs.nr_files = nr_files;
+	fs.csums = Malloc(sizeof(unsigned int) * nr_files);
+	fs.next = 0;
 
-	strcpy(filename, dir);
-	strcat(filename, ".idx");
-	SYS(fd_idx = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	threads = Malloc(sizeof(pthread_t) * nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		SYS(pthread_create(&threads[i], NULL, generate_files, &fs));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
 
-	/* write the number of files in the index file */
-	sprintf(idx_buf, "%d\n", nr_files);
-	Rio_write(fd_idx, idx_buf, strlen(idx_buf));
-
-	/* write the rest of the buffer */
-	Rio_write(fd_idx, idx_buffer, strlen(idx_buffer));
-	SYS(close(fd_idx));
-	
-	printf("file set size = %d, nr files = %d\n"
+	write_index(&fs);
+
+	printf("file set size = %lld, nr files = %d\n"
 	       "mean file size = %d, expected mean file size = %d\n",
 	       current_fileset_sz, nr_files,
 	       (int)((double)current_fileset_sz / nr_files),
 	       default_file_sz * 4096);
+	free(threads);
+	free(fs.csums);
+	free(fs.sizes);
 	exit(0);
 }
@@ -2,69 +2,225 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+#define _GNU_SOURCE	/* for strptime */
+#include <time.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
 #include "common.h"
 #include "request.h"
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	char *if_none_match;	/* the conditional headers, NULL if not sent */
+	long if_modified_since;	/* -1 if not sent */
+	char *range;		/* the Range header, NULL if not sent */
+	int accept_gzip;	/* Accept-Encoding allows gzip */
+	int gzip;		/* the response is sent gzip encoded */
+	int http_minor;		/* 1 for an HTTP/1.1 request, else 0 */
+	int keep_alive;		/* the connection stays open after this */
+	request_disk_fn disk_fn;	/* told about disk waits, NULL if none */
+	void *disk_arg;
 };
 
-/* requestError(fd, filename, "404", "Not found", 
+/* whether connections can be kept open for more requests */
+static int keep_alive_on;
+
+/* tell the disk hook of rq, if any, that a wait for the disk begins or ends */
+static void
+request_disk(struct request *rq, int begin)
+{
+	if (rq->disk_fn)
+		rq->disk_fn(rq->disk_arg, begin);
+}
+
+/* a Range request with more ranges than this gets the whole file */
+#define RANGE_MAX 16
+#define RANGE_BOUNDARY "OS_Web_Server_byteranges_3d9f"
+
+struct range {
+	long first;		/* first and last byte, inclusive */
+	long last;
+};
+
+/* requestError(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
+ * the response has no Connection header, so it ends the connection.
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
 {
 	char buf[MAXLINE], body[MAXBUF];
+	struct iovec iov[2];
 	int i;
 	unsigned int csum = 0;
 
 	/* create the body of the error message */
-	sprintf(body, "<html><title>OS Web Server Error</title>");
-	sprintf(body + strlen(body), "<body bgcolor=" "fffff" ">\r\n");
-	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", errnum, shortmsg);
-	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
-	sprintf(body + strlen(body), "</body></html>\r\n");
+	snprintf(body, sizeof(body), "<html><title>OS Web Server Error</title>"
+		 "<body bgcolor=" "fffff" ">\r\n"
+		 "<p>%s: %s</p>\r\n"
+		 "<p>%s: %.*s</p>\r\n"
+		 "</body></html>\r\n", errnum, shortmsg, longmsg,
+		 MAXBUF / 2, cause);
+
+	/* generate a very trivial checksum */
+	for (i = 0; i < strlen(body); i++) {
+		csum += (unsigned char)(body[i]);
+	}
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* put together the header information for this response */
+	snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+		 "Content-Type: text/html\r\n"
+		 "Content-Length: %ld\r\n"
+		 "Content-Csum: %u\r\n\r\n",
+		 errnum, shortmsg, strlen(body), csum);
+	printf("%s%s", buf, body);
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* write out the header and the content together */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = strlen(buf);
+	iov[1].iov_base = body;
+	iov[1].iov_len = strlen(body);
+	Rio_writev(rq->fd, iov, 2);
+	rq->keep_alive = 0;
+}
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* the response used to shed load. it is built once, so that shedding a
+ * request costs a single send. */
+static char shed_response[MAXBUF];
+static int shed_length;
 
-	/* generate a very trivial checksum */
+void
+request_shed_init(int retry_after)
+{
+	char body[MAXLINE];
+	int i;
+	unsigned int csum = 0;
+
+	sprintf(body, "<html><title>OS Web Server Error</title>");
+	sprintf(body + strlen(body), "<body bgcolor=" "fffff" ">\r\n");
+	sprintf(body + strlen(body), "<p>503: Service Unavailable</p>\r\n");
+	sprintf(body + strlen(body), "<p>OS Web Server is overloaded, "
+		"try again later</p>\r\n");
+	sprintf(body + strlen(body), "</body></html>\r\n");
 	for (i = 0; i < strlen(body); i++) {
 		csum += (unsigned char)(body[i]);
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	shed_length = snprintf(shed_response, sizeof(shed_response),
+			       "HTTP/1.0 503 Service Unavailable\r\n"
+			       "Server: OS Web Server\r\n"
+			       "Retry-After: %d\r\n"
+			       "Content-Type: text/html\r\n"
+			       "Content-Length: %ld\r\n"
+			       "Content-Csum: %u\r\n\r\n%s",
+			       retry_after, strlen(body), csum, body);
+	assert(shed_length < sizeof(shed_response));
+}
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+/* answer connfd with the 503 response from request_shed_init() and close it,
+ * without ever blocking the caller. the request is not parsed, but whatever
+ * part of it has arrived is discarded, so that closing the connection does
+ * not reset it before the client reads the response. */
+void
+request_shed(int connfd)
+{
+	char buf[MAXBUF];
 
+	assert(shed_length > 0);
+	while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+	/* a full socket buffer or a closed connection is the client's loss */
+	send(connfd, shed_response, shed_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(connfd, SHUT_WR);
+	SYS(close(connfd));
 }
 
-/* reads and discards everything up to an empty text line */
+/* keep connections open for more requests when on, see request_keep_alive */
+void
+request_keep_alive_init(int on)
+{
+	keep_alive_on = on;
+}
+
+/* returns the value of the header line buf if it is the header name, with the
+ * surrounding spaces and the line end removed, or NULL */
+static char *
+request_header_value(char *buf, char *name)
+{
+	size_t len = strlen(name);
+	char *value, *end;
+
+	if (strncasecmp(buf, name, len) != 0 || buf[len] != ':')
+		return NULL;
+	for (value = buf + len + 1; *value == ' ' || *value == '\t'; value++);
+	end = value + strlen(value);
+	while (end > value && isspace((unsigned char)end[-1]))
+		end--;
+	*end = 0;
+	return value;
+}
+
+/* whether an Accept-Encoding value allows gzip. gzip, or else *, has to be
+ * in the list, without a q=0 */
+static int
+request_accepts_gzip(char *value)
+{
+	char *tok, *save, *q;
+	int gzip = -1, any = 0, ok;
+
+	for (tok = strtok_r(value, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		while (*tok == ' ' || *tok == '\t')
+			tok++;
+		q = strstr(tok, "q=");
+		ok = !q || strtod(q + 2, NULL) > 0;
+		if (strncasecmp(tok, "gzip", 4) == 0 &&
+		    !isalnum((unsigned char)tok[4]))
+			gzip = ok;
+		else if (tok[0] == '*')
+			any = ok;
+	}
+	return gzip >= 0 ? gzip : any;
+}
+
+/* reads everything up to an empty text line, keeping the conditional
+ * headers, the Range, whether gzip is accepted and whether the connection
+ * is kept open */
 static void
-request_read_headers(struct rio *rp)
+request_read_headers(struct rio *rp, struct request *rq)
 {
 	char buf[MAXLINE];
+	char *value;
+	struct tm tm;
+	/* HTTP/1.1 connections persist, unless they say otherwise */
+	int keep_alive = rq->http_minor == 1;
 
 	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
+	while (strcmp(buf, "\r\n") && buf[0]) {
+		if ((value = request_header_value(buf, "If-None-Match"))) {
+			free(rq->if_none_match);
+			rq->if_none_match = strdup(value);
+		} else if ((value = request_header_value(buf,
+							 "If-Modified-Since"))) {
+			memset(&tm, 0, sizeof(tm));
+			/* an invalid date is ignored */
+			if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+				rq->if_modified_since = timegm(&tm);
+		} else if ((value = request_header_value(buf, "Range"))) {
+			free(rq->range);
+			rq->range = strdup(value);
+		} else if ((value = request_header_value(buf,
+							 "Accept-Encoding"))) {
+			rq->accept_gzip = request_accepts_gzip(value);
+		} else if ((value = request_header_value(buf, "Connection"))) {
+			if (strcasestr(value, "close"))
+				keep_alive = 0;
+			else if (strcasestr(value, "keep-alive"))
+				keep_alive = 1;
+		}
 		Rio_readlineb(rp, buf, MAXLINE);
 	}
-	return;
+	rq->keep_alive = keep_alive_on && keep_alive;
 }
 
 
@@ -74,11 +230,15 @@ request_read_headers(struct rio *rp)
  * Adding the "./" means that files will only be served from the directory in
  * which the webserver is running.
  *
- * Also, we don't serve files with a .. in the path (see request_readfile). */
-static void
+ * Also, we don't serve files with a .. in the path (see request_readfile).
+ * Returns 0 if the file name doesn't fit in max bytes. */
+static int
 request_parse_URI(char *uri, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	/* /a and a name the same file, and the same cache entry */
+	while (*uri == '/')
+		uri++;
+	return snprintf(filename, max, "./%s", uri) < max;
 }
 
 /* Fills in the filetype given the filename */
@@ -97,58 +257,244 @@ request_get_file_type(char *filename, char *filetype)
 
 /* entry point to this file */
 /* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
+ * and rq->file_name with the file that is being requested. the request is
+ * read through rio, which keeps what follows it on the connection, e.g., the
+ * requests that the client pipelined behind it.
+ * Returns NULL on failure, or if the connection was closed.
  */
 struct request *
-request_init(int connfd, struct file_data *data)
+request_init(int connfd, struct rio *rio, struct file_data *data)
 {
 	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
 	rq = Malloc(sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
+	rq->if_none_match = NULL;
+	rq->if_modified_since = -1;
+	rq->range = NULL;
+	rq->accept_gzip = 0;
+	rq->gzip = 0;
+	rq->http_minor = 0;
+	rq->keep_alive = 0;
+	rq->disk_fn = NULL;
+	rq->disk_arg = NULL;
 	data->file_name = Malloc(MAXLINE);
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
+	data->file_mapped = 0;
+	data->file_mtime = 0;
+	data->gzip_buf = NULL;
+	data->gzip_size = 0;
+	data->file_csum = 0;
+	if (Rio_readlineb(rio, buf, MAXLINE) == 0) {
+		request_destroy(rq);
+		return NULL;
+	}
+	method[0] = version[0] = 0;
 	sscanf(buf, "%s %s %s", method, uri, version);
 
 	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
 	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	if (strcmp(version, "HTTP/1.1") == 0)
+		rq->http_minor = 1;
+	request_read_headers(rio, rq);
+	if (!request_parse_URI(uri, data->file_name, MAXLINE)) {
+		/* a truncated name could be that of another file */
+		request_error(rq, method, "414", "URI Too Long",
+			     "OS Web Server could not handle this file name");
+		request_destroy(rq);
+		return NULL;
+	}
 	return rq;
 }
 
+/* look at the request line that has arrived on connfd, without consuming it or
+ * blocking, and fill filename with the file that it requests, as
+ * request_init() would. Returns 1 on success, 0 if a complete GET request line
+ * has not arrived yet. */
+int
+request_peek(int connfd, char *filename, size_t max)
+{
+	char buf[MAXLINE], method[16], uri[MAXLINE];
+	ssize_t n;
+
+	n = recv(connfd, buf, sizeof(buf) - 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n <= 0)
+		return 0;
+	buf[n] = 0;
+	if (!strchr(buf, '\n'))
+		return 0;
+	if (sscanf(buf, "%15s %8191s", method, uri) != 2 ||
+	    strcasecmp(method, "GET"))
+		return 0;
+	return request_parse_URI(uri, filename, max);
+}
+
+/* the connection fd is left open, see request_keep_alive */
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
-	/* close the connection fd */
-	SYS(close(rq->fd));
+	free(rq->if_none_match);
+	free(rq->range);
 	free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+/* read data->file_size bytes of data->file_name into data->file_buf */
+static void
+request_readdata(struct file_data *data)
+{
+	int srcfd;
+
+	SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+	data->file_buf = Malloc(data->file_size);
+	Rio_read(srcfd, data->file_buf, data->file_size);
+	/* ask the kernel to stop caching the file */
+	SYS(posix_fadvise(srcfd, 0, data->file_size, 
+			  POSIX_FADV_DONTNEED));
+	SYS(close(srcfd));
+}
+
+/* map data->file_size bytes of data->file_name read-only into data->file_buf,
+ * see the REQUEST_MAP flags. the mapping stays valid after the file is closed,
+ * and its pages can be shared with the page cache and other processes. */
+static void
+request_mapdata(struct file_data *data, int flags)
+{
+	static int lock_warned;
+	int srcfd;
+
+	SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+	data->file_buf = mmap(NULL, data->file_size, PROT_READ,
+			      MAP_SHARED | ((flags & REQUEST_MAP_POPULATE) ?
+					    MAP_POPULATE : 0), srcfd, 0);
+	if (data->file_buf == MAP_FAILED)
+		unix_error("mmap");
+	data->file_mapped = 1;
+	SYS(close(srcfd));
+	if ((flags & REQUEST_MAP_LOCK) &&
+	    mlock(data->file_buf, data->file_size) < 0 && !lock_warned) {
+		/* usually RLIMIT_MEMLOCK, the data is still usable */
+		lock_warned = 1;
+		perror("warning: mlock");
+	}
+}
+
+/* read in or map the file data, as the flags say */
+static void
+request_getdata(struct file_data *data, int flags)
+{
+	if (flags & REQUEST_MAP)
+		request_mapdata(data, flags);
+	else
+		request_readdata(data);
+}
+
+/* free the file data, but not its compressed variant */
+static void
+request_freeplain(struct file_data *data)
+{
+	if (data->file_mapped) {
+		if (data->file_size > 0)
+			SYS(munmap(data->file_buf, data->file_size));
+	} else {
+		free(data->file_buf);
+	}
+	data->file_buf = NULL;
+	data->file_mapped = 0;
+}
+
+/* free the data read in, mapped or compressed by the functions here */
+void
+request_freedata(struct file_data *data)
+{
+	request_freeplain(data);
+	free(data->gzip_buf);
+	data->gzip_buf = NULL;
+	data->gzip_size = 0;
+}
+
+/* add a gzip variant of the file data in data->gzip_buf, compressed at level
+ * (1-9), and without keep, free the file data, which is then inflated for the
+ * clients that don't take gzip. Returns 1 if the variant was added, and 0 if
+ * it would not be smaller than the file. */
+int
+request_gzipdata(struct file_data *data, int level, int keep)
+{
+	z_stream zs;
+	unsigned long max;
+	int i, ret;
+
+	if (data->file_size == 0)
+		return 0;
+	memset(&zs, 0, sizeof(zs));
+	/* 16 + the largest window asks for a gzip header and trailer */
+	ret = deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+			   Z_DEFAULT_STRATEGY);
+	assert(ret == Z_OK);
+	max = deflateBound(&zs, data->file_size);
+	data->gzip_buf = Malloc(max);
+	zs.next_in = (unsigned char *)data->file_buf;
+	zs.avail_in = data->file_size;
+	zs.next_out = (unsigned char *)data->gzip_buf;
+	zs.avail_out = max;
+	ret = deflate(&zs, Z_FINISH);
+	assert(ret == Z_STREAM_END);
+	(void)ret;	/* only checked by the asserts */
+	data->gzip_size = zs.total_out;
+	deflateEnd(&zs);
+	if (data->gzip_size >= data->file_size) {
+		free(data->gzip_buf);
+		data->gzip_buf = NULL;
+		data->gzip_size = 0;
+		return 0;
+	}
+	/* trim the buffer to the compressed size */
+	data->gzip_buf = realloc(data->gzip_buf, data->gzip_size);
+	assert(data->gzip_buf);
+	data->file_csum = 0;
+	for (i = 0; i < data->file_size; i++) {
+		data->file_csum += (unsigned char)(data->file_buf[i]);
+	}
+	if (!keep)
+		request_freeplain(data);
+	return 1;
+}
+
+/* inflate data->gzip_buf into buf, which has room for the file */
+static void
+request_gunzipdata(struct file_data *data, char *buf)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	ret = inflateInit2(&zs, 16 + MAX_WBITS);
+	assert(ret == Z_OK);
+	zs.next_in = (unsigned char *)data->gzip_buf;
+	zs.avail_in = data->gzip_size;
+	zs.next_out = (unsigned char *)buf;
+	zs.avail_out = data->file_size;
+	ret = inflate(&zs, Z_FINISH);
+	assert(ret == Z_STREAM_END && zs.total_out == data->file_size);
+	(void)ret;	/* only checked by the asserts */
+	inflateEnd(&zs);
+}
+
+/* check that the file corresponding to request can be served, and stat it.
+ * Returns 1 on success, and fills sbuf.
  * Returns 0 on failure, sends error to client. */
 int
-request_readfile(struct request *rq)
+request_stat(struct request *rq, struct stat *sbuf)
 {
-	int srcfd;
-	struct stat sbuf;
 	struct file_data *data;
 	char *ext;
 
@@ -159,54 +505,100 @@ request_readfile(struct request *rq)
 	if (data->file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with absolute paths");
 		return 0;
 	}
 	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with .. in the path");
 		return 0;
 	}
 	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve C or header files ");
 		return 0;
 	}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+	if (stat(data->file_name, sbuf) < 0) {
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server could not find this file");
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+		request_error(rq, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
+	data->file_mtime = sbuf->st_mtime;
+	return 1;
+}
 
+/* read in filename corresponding to request, or map it when flags has
+ * REQUEST_MAP. Returns 1 on success, and fills rq->file_buf, and
+ * rq->file_size. Returns 0 on failure, sends error to client. */
+int
+request_mapfile(struct request *rq, int flags)
+{
+	struct stat sbuf;
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_stat(rq, &sbuf))
+		return 0;
 	data->file_size = sbuf.st_size;
 
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
+		request_disk(rq, 1);
+		request_getdata(data, flags);
 		/* we do this to simulate a slow disk. otherwise, file caching
 		 * doesn't have much benefit because a lot of the time is spent
 		 * in processing (see request_processfile below) and so
 		 * request_readfile does not have much impact. */
 		usleep(10000);
+		request_disk(rq, 0);
 	}
 	return 1;
 }
 
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readfile(struct request *rq)
+{
+	return request_mapfile(rq, 0);
+}
+
+/* read in or map data->file_name without a client request, e.g., to warm up
+ * the cache. Returns 1 on success and fills data->file_buf and
+ * data->file_size. Returns 0 if the file is not a readable regular file. */
+int
+request_loadfile(struct file_data *data, int flags)
+{
+	struct stat sbuf;
+
+	if (stat(data->file_name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    !(S_IRUSR & sbuf.st_mode))
+		return 0;
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtime;
+	if (data->file_size)
+		request_getdata(data, flags);
+	return 1;
+}
+
+char *
+request_file_name(struct request *rq)
+{
+	return rq->data->file_name;
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -214,57 +606,507 @@ request_set_data(struct request *rq, struct file_data *data)
 	rq->data = data;
 }
 
+/* have fn called around each wait for the disk while serving rq, e.g., to
+ * measure how long the thread is blocked */
+void
+request_set_disk_hook(struct request *rq, request_disk_fn fn, void *arg)
+{
+	rq->disk_fn = fn;
+	rq->disk_arg = arg;
+}
+
 /* process file, the main reason for this function is that if we don't do enough
  * processing on the file, the network becomes the bottleneck, and then the
  * various server parameters have no affect on server performance. this is a
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
  * have to do this artificial work. */
 static void
-request_processfile(struct request *rq)
+request_processbuf(char *buf, int size)
 {
-	struct file_data *data;
 	int i, j, dummy;
-	data = rq->data;
-	assert(data);
 
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
+		for (j = 0; j < size; j++) {
+			dummy += (unsigned char)(buf[j]);
 		}
 	}
 }
 
-/* send filename to the fd connection */
-void
+/* the entity tag of a file. the checksum alone would miss a change that
+ * keeps the sum of the bytes, so the size and mtime are part of it too. the
+ * gzip variant is a different entity, with a tag of its own. */
+static void
+request_etag(struct request *rq, long size, unsigned int csum, char *etag,
+	     size_t max)
+{
+	snprintf(etag, max, "\"%08x-%lx-%lx%s\"", csum, size,
+		 rq->data->file_mtime, rq->gzip ? "-gzip" : "");
+}
+
+static void
+request_http_date(long t, char *date, size_t max)
+{
+	time_t tt = t;
+	struct tm tm;
+
+	gmtime_r(&tt, &tm);
+	strftime(date, max, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* put together the status line of a response, and the headers that every
+ * response has, returns their length. the response has the version of the
+ * request, and says whether the connection stays open when that is not what
+ * the version implies. */
+static int
+request_status(struct request *rq, char *status, char *buf, size_t max)
+{
+	char *connection = "";
+
+	if (rq->http_minor == 1 && !rq->keep_alive)
+		connection = "Connection: close\r\n";
+	else if (rq->http_minor == 0 && rq->keep_alive)
+		connection = "Connection: keep-alive\r\n";
+	return snprintf(buf, max, "HTTP/1.%d %s\r\n"
+			"Server: OS Web Server\r\n%s", rq->http_minor, status,
+			connection);
+}
+
+/* whether the connection can be used for the next request, once the
+ * response to this one has been sent */
+int
+request_keep_alive(struct request *rq)
+{
+	return rq->keep_alive;
+}
+
+/* put together the header of a response with the file, returns its length.
+ * the gzip variant has the checksum of the file, before it was compressed. */
+static int
+request_header(struct request *rq, char *buf, size_t max, long size,
+	       unsigned int csum)
+{
+	char filetype[32], etag[64], date[64];
+	int n;
+
+	request_get_file_type(rq->data->file_name, filetype);
+	request_etag(rq, size, csum, etag, sizeof(etag));
+	request_http_date(rq->data->file_mtime, date, sizeof(date));
+	n = request_status(rq, "200 OK", buf, max);
+	return n + snprintf(buf + n, max - n, "Content-Type: %s\r\n"
+			"Content-Length: %ld\r\n"
+			"Content-Csum: %u\r\n"
+			"%s%s"
+			"Accept-Ranges: bytes\r\n"
+			"ETag: %s\r\n"
+			"Last-Modified: %s\r\n\r\n",
+			filetype, rq->gzip ? rq->data->gzip_size : size, csum,
+			rq->gzip ? "Content-Encoding: gzip\r\n" : "",
+			rq->data->gzip_buf ? "Vary: Accept-Encoding\r\n" : "",
+			etag, date);
+}
+
+/* if the client already has this version of the file, as its conditional
+ * headers say, answer with a 304 without a body and return 1. If-None-Match
+ * takes precedence over If-Modified-Since, as in RFC 7232. */
+int
+request_not_modified(struct request *rq, long size, unsigned int csum)
+{
+	char buf[MAXBUF], etag[64], date[64];
+	int n;
+
+	request_etag(rq, size, csum, etag, sizeof(etag));
+	if (rq->if_none_match) {
+		/* a list of tags, or *. the tags are compared weakly, so a W/
+		 * in front of one doesn't matter */
+		if (strcmp(rq->if_none_match, "*") &&
+		    !strstr(rq->if_none_match, etag))
+			return 0;
+	} else if (rq->if_modified_since < 0 ||
+		   rq->data->file_mtime > rq->if_modified_since) {
+		return 0;
+	}
+	request_http_date(rq->data->file_mtime, date, sizeof(date));
+	n = request_status(rq, "304 Not Modified", buf, sizeof(buf));
+	n += snprintf(buf + n, sizeof(buf) - n, "ETag: %s\r\n"
+		     "Last-Modified: %s\r\n\r\n", etag, date);
+	Rio_write(rq->fd, buf, n);
+	return 1;
+}
+
+
+/* whether the client asked for parts of the file with a Range header */
+int
+request_has_range(struct request *rq)
+{
+	return rq->range != NULL;
+}
+
+/* parse the Range header for a file of size bytes into ranges, in the order
+ * they were asked for. Returns the nr of ranges, 0 if the header is not a
+ * bytes range that we serve, in which case the whole file is sent, and -1 if
+ * none of the ranges overlap the file. */
+static int
+request_parse_ranges(struct request *rq, long size, struct range *ranges)
+{
+	char *p = rq->range;
+	int nr = 0, nr_specs = 0;
+
+	if (strncasecmp(p, "bytes=", 6) != 0)
+		return 0;
+	p += 6;
+	while (1) {
+		long first = -1, last = -1;
+		char *end;
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (isdigit((unsigned char)*p)) {	/* first-[last] */
+			first = strtol(p, &end, 10);
+			if (*end != '-')
+				return 0;
+			p = end + 1;
+			if (isdigit((unsigned char)*p)) {
+				last = strtol(p, &end, 10);
+				if (last < first)
+					return 0;
+				p = end;
+			}
+		} else if (*p == '-' && isdigit((unsigned char)p[1])) {
+			/* -suffix_length */
+			long suffix = strtol(p + 1, &end, 10);
+			p = end;
+			if (suffix == 0) {
+				first = size;	/* can't be satisfied */
+			} else {
+				first = suffix < size ? size - suffix : 0;
+			}
+		} else {
+			return 0;
+		}
+		if (++nr_specs > RANGE_MAX)
+			return 0;
+		if (first < size) {
+			ranges[nr].first = first;
+			ranges[nr].last = (last < 0 || last >= size) ?
+				size - 1 : last;
+			nr++;
+		}
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0')
+			break;
+		if (*p++ != ',')
+			return 0;
+	}
+	return nr > 0 ? nr : -1;
+}
+
+/* the response to a Range that doesn't overlap the file */
+static void
+request_range_error(struct request *rq, long size)
+{
+	char buf[MAXLINE];
+	int n;
+
+	n = request_status(rq, "416 Range Not Satisfiable", buf, sizeof(buf));
+	n += snprintf(buf + n, sizeof(buf) - n, "Content-Range: bytes */%ld\r\n"
+		     "Content-Length: 0\r\n\r\n", size);
+	Rio_write(rq->fd, buf, n);
+}
+
+/* put together the header of a 206 response in hdr, and with more than one
+ * range, the header of each part in parts. part i starts at part_off[i], and
+ * the closing boundary at part_off[nr]. Returns the length of the body. */
+static long
+request_range_headers(struct request *rq, long size, unsigned int csum,
+		      struct range *ranges, int nr, char *hdr, size_t max,
+		      char *parts, int *part_off)
+{
+	char filetype[32], etag[64], date[64];
+	char type[sizeof("multipart/byteranges; boundary=" RANGE_BOUNDARY)];
+	long length = 0;
+	int i, n, off = 0;
+
+	request_get_file_type(rq->data->file_name, filetype);
+	request_etag(rq, size, csum, etag, sizeof(etag));
+	request_http_date(rq->data->file_mtime, date, sizeof(date));
+	for (i = 0; i < nr; i++) {
+		length += ranges[i].last - ranges[i].first + 1;
+	}
+	if (nr == 1) {
+		n = request_status(rq, "206 Partial Content", hdr, max);
+		snprintf(hdr + n, max - n, "Content-Type: %s\r\n"
+			 "Content-Length: %ld\r\n"
+			 "Content-Range: bytes %ld-%ld/%ld\r\n"
+			 "ETag: %s\r\n"
+			 "Last-Modified: %s\r\n\r\n", filetype, length,
+			 ranges[0].first, ranges[0].last, size, etag, date);
+		return length;
+	}
+	/* each part is preceded by a boundary and its own header */
+	for (i = 0; i < nr; i++) {
+		part_off[i] = off;
+		off += sprintf(parts + off, "\r\n--" RANGE_BOUNDARY "\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			       filetype, ranges[i].first, ranges[i].last,
+			       size);
+	}
+	part_off[nr] = off;
+	off += sprintf(parts + off, "\r\n--" RANGE_BOUNDARY "--\r\n");
+	length += off;
+	snprintf(type, sizeof(type), "multipart/byteranges; boundary="
+		 RANGE_BOUNDARY);
+	n = request_status(rq, "206 Partial Content", hdr, max);
+	snprintf(hdr + n, max - n, "Content-Type: %s\r\n"
+		 "Content-Length: %ld\r\n"
+		 "ETag: %s\r\n"
+		 "Last-Modified: %s\r\n\r\n", type, length, etag, date);
+	return length;
+}
+
+/* the header of each part of a multipart response is less than this */
+#define RANGE_PART_HDR 256
+
+/* answer a Range request from file data in memory. only the bytes that are
+ * sent are processed. Returns the nr of file bytes sent, or -1 if the Range
+ * header can't be used, and nothing was sent. */
+static long
+request_send_buf_ranges(struct request *rq, long size, unsigned int csum,
+			char *data)
+{
+	struct range ranges[RANGE_MAX];
+	char hdr[MAXBUF], parts[RANGE_MAX * RANGE_PART_HDR + 64];
+	int part_off[RANGE_MAX + 1];
+	struct iovec iov[2 * RANGE_MAX + 2];
+	long sent = 0;
+	int i, nr, iovcnt = 0;
+
+	nr = request_parse_ranges(rq, size, ranges);
+	if (nr == 0)
+		return -1;
+	if (nr < 0) {
+		request_range_error(rq, size);
+		return 0;
+	}
+	request_range_headers(rq, size, csum, ranges, nr, hdr, sizeof(hdr),
+			      parts, part_off);
+	iov[iovcnt].iov_base = hdr;
+	iov[iovcnt++].iov_len = strlen(hdr);
+	for (i = 0; i < nr; i++) {
+		long len = ranges[i].last - ranges[i].first + 1;
+		if (nr > 1) {
+			iov[iovcnt].iov_base = parts + part_off[i];
+			iov[iovcnt++].iov_len = part_off[i + 1] - part_off[i];
+		}
+		request_processbuf(data + ranges[i].first, len);
+		iov[iovcnt].iov_base = data + ranges[i].first;
+		iov[iovcnt++].iov_len = len;
+		sent += len;
+	}
+	if (nr > 1) {
+		iov[iovcnt].iov_base = parts + part_off[nr];
+		iov[iovcnt++].iov_len = strlen(parts + part_off[nr]);
+	}
+	Rio_writev(rq->fd, iov, iovcnt);
+	return sent;
+}
+
+/* send count bytes of srcfd from offset without copying them to user space */
+static void
+request_send_file_range(int fd, int srcfd, off_t offset, long count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = sendfile(fd, srcfd, &offset, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			unix_error("sendfile");
+		if (n == 0)	/* the file was truncated */
+			break;
+		count -= n;
+	}
+}
+
+/* answer a Range request from the requested file, a file of size bytes with
+ * checksum csum. the parts of the file are sent from the page cache with
+ * sendfile(2), so they are neither read into memory nor processed. Returns the
+ * nr of file bytes sent, or -1 if the Range header can't be used, and nothing
+ * was sent. */
+long
+request_sendfile_ranges(struct request *rq, long size, unsigned int csum)
+{
+	struct range ranges[RANGE_MAX];
+	char hdr[MAXBUF], parts[RANGE_MAX * RANGE_PART_HDR + 64];
+	int part_off[RANGE_MAX + 1];
+	long sent = 0;
+	int i, nr, srcfd;
+
+	nr = request_parse_ranges(rq, size, ranges);
+	if (nr == 0)
+		return -1;
+	if (nr < 0) {
+		request_range_error(rq, size);
+		return 0;
+	}
+	request_range_headers(rq, size, csum, ranges, nr, hdr, sizeof(hdr),
+			      parts, part_off);
+	SYS(srcfd = open(rq->data->file_name, O_RDONLY, 0));
+	Rio_write(rq->fd, hdr, strlen(hdr));
+	/* a slow disk, as in request_readfile. sendfile reads while it
+	 * sends, so only this wait is counted as waiting for the disk */
+	request_disk(rq, 1);
+	usleep(10000);
+	request_disk(rq, 0);
+	for (i = 0; i < nr; i++) {
+		long len = ranges[i].last - ranges[i].first + 1;
+		if (nr > 1) {
+			Rio_write(rq->fd, parts + part_off[i],
+				  part_off[i + 1] - part_off[i]);
+		}
+		request_send_file_range(rq->fd, srcfd, ranges[i].first, len);
+		sent += len;
+	}
+	if (nr > 1)
+		Rio_write(rq->fd, parts + part_off[nr],
+			  strlen(parts + part_off[nr]));
+	SYS(close(srcfd));
+	return sent;
+}
+
+/* send filename to the fd connection. the header and the file data are sent
+ * with one writev, so that a small file goes out in a single system call.
+ * With a Range header, only the parts asked for are sent. A client that takes
+ * gzip gets the gzip variant, if there is one, unless it asked for ranges.
+ * Returns the nr of file bytes sent, or -1 if the client has the file already
+ * and got a 304. */
+long
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
+	long sent;
+	char buf[MAXBUF];
+	struct iovec iov[2];
 	int i;
 	unsigned int csum = 0;
 	struct file_data *data;
-	long size = 0;
+	char *file_buf, *plain = NULL;
+	char *body;
+	long length;
 
 	data = rq->data;
 	assert(data);
+	file_buf = data->file_buf;
 
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	if (file_buf == NULL && data->gzip_buf) {
+		/* only the gzip variant was kept */
+		csum = data->file_csum;
+	} else {
+		/* generate a very trivial checksum */
+		for (i = 0; i < data->file_size; i++) {
+			csum += (unsigned char)(file_buf[i]);
+		}
+	}
+	rq->gzip = data->gzip_buf && rq->accept_gzip && !rq->range;
+	if (request_not_modified(rq, data->file_size, csum))
+		return -1;
+	if (!rq->gzip && file_buf == NULL && data->file_size > 0) {
+		file_buf = plain = Malloc(data->file_size);
+		request_gunzipdata(data, plain);
 	}
+	if (rq->range && (sent = request_send_buf_ranges(rq, data->file_size,
+							 csum,
+							 file_buf)) >= 0) {
+		free(plain);
+		return sent;
+	}
+	body = rq->gzip ? data->gzip_buf : file_buf;
+	length = rq->gzip ? data->gzip_size : data->file_size;
 	/* do some processing */
-	request_processfile(rq);
+	request_processbuf(body, length);
 	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	request_header(rq, buf, sizeof(buf), data->file_size, csum);
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = strlen(buf);
+	/* the data follows the header */
+	iov[1].iov_base = body;
+	iov[1].iov_len = length;
+	Rio_writev(rq->fd, iov, length > 0 ? 2 : 1);
+	free(plain);
+	return length;
+}
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+/* whether the response was the gzip variant of the file */
+int
+request_sent_gzip(struct request *rq)
+{
+	return rq->gzip;
+}
+
+/* compute the checksum of the first size bytes of the requested file, reading
+ * it through buf, so that it can be streamed with request_streamfile */
+unsigned int
+request_csumfile(struct request *rq, long size, char *buf, int buf_size)
+{
+	unsigned int csum = 0;
+	int srcfd, i, n;
+
+	SYS(srcfd = open(rq->data->file_name, O_RDONLY, 0));
+	while (size > 0) {
+		request_disk(rq, 1);
+		n = Rio_read(srcfd, buf, size < buf_size ? size : buf_size);
+		request_disk(rq, 0);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++) {
+			csum += (unsigned char)(buf[i]);
+		}
+		size -= n;
+	}
+	SYS(close(srcfd));
+	return csum;
+}
+
+/* send size bytes of the requested file without reading all of it into
+ * memory. each chunk is read into buf, processed and sent, so the memory used
+ * does not depend on the file size. the checksum in the header has to be known
+ * up front, see request_csumfile. Returns the checksum of the data sent, which
+ * differs from csum if the file changed in the meantime. */
+unsigned int
+request_streamfile(struct request *rq, long size, unsigned int csum, char *buf,
+		   int buf_size)
+{
+	char hdr[MAXBUF];
+	unsigned int sent_csum = 0;
+	int srcfd, i, n;
+
+	SYS(srcfd = open(rq->data->file_name, O_RDONLY, 0));
+	Rio_write(rq->fd, hdr, request_header(rq, hdr, sizeof(hdr), size, csum));
+	if (size > 0) {
+		/* a slow disk, as in request_readfile */
+		request_disk(rq, 1);
+		usleep(10000);
+		request_disk(rq, 0);
+	}
+	while (size > 0) {
+		/* only the read waits for the disk, not the write below */
+		request_disk(rq, 1);
+		n = Rio_read(srcfd, buf, size < buf_size ? size : buf_size);
+		request_disk(rq, 0);
+		if (n == 0) {
+			/* the file was truncated, the client will notice */
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			sent_csum += (unsigned char)(buf[i]);
+		}
+		request_processbuf(buf, n);
+		Rio_write(rq->fd, buf, n);
+		size -= n;
 	}
+	SYS(posix_fadvise(srcfd, 0, 0, POSIX_FADV_DONTNEED));
+	SYS(close(srcfd));
+	return sent_csum;
 }
@@ -5,12 +5,46 @@ struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	int file_mapped; /* file_buf is mapped from the file, not malloced */
+	long file_mtime; /* last modification, in seconds since the epoch */
+	char *gzip_buf;	 /* the file compressed with gzip, NULL if none */
+	int gzip_size;
+	unsigned int file_csum; /* checksum of the file, set with gzip_buf */
 };
 
-struct request *request_init(int connfd, struct file_data *data);
+/* flags for request_mapfile and request_loadfile */
+#define REQUEST_MAP	     1	/* map the file instead of reading it */
+#define REQUEST_MAP_POPULATE 2	/* and fault in all of it up front */
+#define REQUEST_MAP_LOCK     4	/* and lock it in memory */
+
+/* called with begin 1 before and 0 after each wait for the disk */
+typedef void (*request_disk_fn)(void *arg, int begin);
+
+struct request *request_init(int connfd, struct rio *rio,
+			     struct file_data *data);
+int request_peek(int connfd, char *filename, size_t max);
+int request_stat(struct request *rq, struct stat *sbuf);
 int request_readfile(struct request *rq);
+int request_not_modified(struct request *rq, long size, unsigned int csum);
+int request_mapfile(struct request *rq, int flags);
+int request_loadfile(struct file_data *data, int flags);
+void request_freedata(struct file_data *data);
+int request_gzipdata(struct file_data *data, int level, int keep);
+char *request_file_name(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
-void request_sendfile(struct request *rq);
+void request_set_disk_hook(struct request *rq, request_disk_fn fn, void *arg);
+long request_sendfile(struct request *rq);
+int request_has_range(struct request *rq);
+int request_sent_gzip(struct request *rq);
+long request_sendfile_ranges(struct request *rq, long size, unsigned int csum);
+unsigned int request_csumfile(struct request *rq, long size, char *buf,
+			      int buf_size);
+unsigned int request_streamfile(struct request *rq, long size,
+				unsigned int csum, char *buf, int buf_size);
 void request_destroy(struct request *rq);
+void request_shed_init(int retry_after);
+void request_shed(int connfd);
+void request_keep_alive_init(int on);
+int request_keep_alive(struct request *rq);
 
 #endif
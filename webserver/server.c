@@ -1,28 +1,73 @@
+#define _GNU_SOURCE	/* for accept4 */
 #include <malloc.h>
+#include <popt.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "slab.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-w index] [-s] [-c target_ms] [-R secs] [-q sjf] [-A aging]
+ *         [-p cpus] [-P cpus] [-b bytes] [-k backend] [-H huge] [-i dir]
+ *         [-z level] [-Z] [-K ms] [-u path] [-D batch] [-T min:max]
+ *         portnum nr_threads max_requests max_cache_size
+ *
+ * With -w, the cache is filled with the files listed in a fileset index before
+ * the server starts accepting connections. With -s, the server answers with a
+ * 503 instead of waiting when its request queue is full, and with -c, also
+ * when requests have waited in the queue for longer than target_ms. With -q sjf,
+ * queued requests are served shortest job first, with aging. -p and -P pin the
+ * worker threads and the accepting thread to cpus. Files larger than -b bytes,
+ * by default those larger than the cache, are streamed in small chunks instead
+ * of being read into memory. With -k, cached files are kept in read-only
+ * mappings of the files, or in an arena of max_cache_size bytes, instead of on
+ * the heap. -H backs the arena with huge pages. With -i, cached files under dir
+ * are dropped as soon as they change on disk. With -z, a gzip variant of each
+ * cached file is kept for the clients that accept it, and with -Z, only that
+ * variant is kept. Connections that ask for it, e.g., with HTTP/1.1, are kept
+ * open until they are idle for -K ms, and the requests that a client pipelines
+ * on them are answered in order. An idle connection waits in the poll set of
+ * the accepting thread, not on a worker. With -u, the server also listens on a unix
+ * domain socket at path, for clients on the same host, and with a portnum of
+ * 0, only there. With -D, each worker takes up to batch queued connections at
+ * a time. With -T, the number of worker threads adapts to the load, between
+ * min and max, starting from nr_threads.
+ *
+ * The server is controlled through the ./server_exit fifo, with one command per
+ * line:
+ *  shutdown            exit, see server_shutdown
+ *  threads nr          grow or shrink the pool of worker threads, which then
+ *                      adapts from there with -T
+ *  queue nr            resize the request queue
+ *  cache bytes         resize the cache, evicting files gradually
+ * so that capacity can be changed under load, without losing the cache. The
+ * new value is printed, and requests that are in flight are not dropped.
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
  */
 
+poptContext context;	/* context for parsing command-line options */
+
 static void
-usage(char *program)
+usage(const char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
+	fprintf(stderr, "Usage: %s [options] port nr_threads max_requests "
 		"max_cache_size\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
 static char *fifo = "./server_exit";
 
+/* the most connections accepted on one wakeup of the acceptor */
+#define ACCEPT_BATCH 64
+/* how long the acceptor waits when it is out of fds or memory, in us */
+#define ACCEPT_BACKOFF 10000
+
 /* we will use this fifo to send a message to the server to exit */
 static int
 open_fifo(void)
@@ -52,59 +97,368 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+/* run one command read from the fifo. returns 1 if the server should exit. */
+static int
+run_command(struct server *sv, char *line)
+{
+	char cmd[16];
+	int nr, ret;
+	const char *name;
+
+	if (sscanf(line, "%15s", cmd) != 1)	/* empty line */
+		return 0;
+	if (strcmp(cmd, "shutdown") == 0)
+		return 1;
+	if (sscanf(line, "%*s %d", &nr) != 1)
+		goto unknown;
+	if (strcmp(cmd, "threads") == 0) {
+		ret = server_set_threads(sv, nr);
+		name = "nr_threads";
+	} else if (strcmp(cmd, "queue") == 0) {
+		ret = server_set_queue(sv, nr);
+		name = "max_requests";
+	} else if (strcmp(cmd, "cache") == 0) {
+		ret = server_set_cache_size(sv, nr);
+		name = "max_cache_size";
+	} else {
+		goto unknown;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "server: can't run %s: the server was started "
+			"without it, or nr < 1\n", line);
+	} else {
+		printf("server: control: %s = %d\n", name, ret);
+		fflush(stdout);
+	}
+	return 0;
+
+unknown:
+	fprintf(stderr, "server: unknown command: %s\n", line);
+	return 0;
+}
+
+/* run the commands that were written to the fifo, one per line. a line that
+ * is not terminated is run when the writer closes the fifo, which is then
+ * opened again, since it would otherwise poll as hung up from then on.
+ * returns 1 if the server should exit. */
+static int
+read_fifo(int *fd, struct server *sv)
+{
+	static char line[MAXLINE];
+	static int len = 0;
+	char *start, *end;
+	int n;
+
+	while ((n = read(*fd, line + len, sizeof(line) - 1 - len)) > 0) {
+		len += n;
+		line[len] = '\0';
+		start = line;
+		while ((end = strchr(start, '\n')) != NULL) {
+			*end = '\0';
+			if (run_command(sv, start))
+				return 1;
+			start = end + 1;
+		}
+		len -= start - line;
+		memmove(line, start, len + 1);
+		if (len == sizeof(line) - 1)	/* too long to be a command */
+			len = 0;
+	}
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			unix_error("read");
+		return 0;
+	}
+
+	/* the writer closed the fifo */
+	if (len > 0 && run_command(sv, line))
+		return 1;
+	len = 0;
+	SYS(close(*fd));
+	SYS(*fd = open(fifo, O_RDONLY | O_NONBLOCK));
+	return 0;
+}
+
 int
-main(int argc, char *argv[])
+main(int argc, const char *argv[])
 {
+	int i;
+	char c;
+	const char *args[4];
 	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
+	int listenfd, connfd;
 	int exitfd;
-	struct sockaddr_in clientaddr;
+	int batch[ACCEPT_BATCH], nr;
+	int backoff;
+	int timeout = -1;
 	struct server *sv;
+	char *warmup_index = NULL;
+	int shed = 0;
+	int codel_target = 0;
+	int retry_after = 1;
+	char *queue_order = "fifo";
+	double sjf_aging = 4.0;
+	char *worker_cpus = NULL;
+	char *acceptor_cpus = NULL;
+	long stream_size = -1;
+	char *cache_backend = "heap";
+	char *huge_pages = NULL;
+	char *watch_dir = NULL;
+	int map_flags;
+	int slab_flags = 0;
+	int gzip_level = 0;
+	int gzip_only = 0;
+	int keepalive_ms = 1000;
+	char *unix_path = NULL;
+	int unixfd = -1;
+	int dequeue_batch = 1;
+	char *adapt_threads = NULL;
+	int adapt_min = 0, adapt_max = 0;
+
+	struct poptOption options_table[] = {
+		{NULL, 'w', POPT_ARG_STRING, &warmup_index, 'w',
+		 "fill the cache with the files in this fileset index", NULL},
+		{NULL, 's', POPT_ARG_NONE, &shed, 0,
+		 "shed load with 503 responses when the request queue is full",
+		 NULL},
+		{NULL, 'c', POPT_ARG_INT, &codel_target, 0,
+		 "also shed requests that wait in the queue for longer than "
+		 "this many ms (CoDel), implies -s", " default: 0 (off)"},
+		{NULL, 'R', POPT_ARG_INT, &retry_after, 0,
+		 "Retry-After seconds in the 503 response", " default: 1"},
+		{NULL, 'q', POPT_ARG_STRING, &queue_order, 0,
+		 "order in which queued requests are served: fifo or sjf "
+		 "(shortest job first)", " default: fifo"},
+		{NULL, 'A', POPT_ARG_DOUBLE, &sjf_aging, 0,
+		 "sjf: a request can be overtaken by one that arrives up to "
+		 "A times the difference in their service times later",
+		 " default: 4"},
+		{NULL, 'p', POPT_ARG_STRING, &worker_cpus, 0,
+		 "pin the worker threads to these cpus in turn, e.g., 0,2,4-7, "
+		 "or auto to spread them over physical cores",
+		 " default: not pinned"},
+		{NULL, 'P', POPT_ARG_STRING, &acceptor_cpus, 0,
+		 "pin the accepting thread to these cpus, or auto to give it a "
+		 "core of its own", " default: not pinned"},
+		{NULL, 'b', POPT_ARG_LONG, &stream_size, 0,
+		 "stream files larger than this many bytes, 0 to never stream",
+		 " default: max_cache_size"},
+		{NULL, 'k', POPT_ARG_STRING, &cache_backend, 0,
+		 "where cached files are kept: heap, arena (a slab allocator "
+		 "with exact accounting), mmap, populate (mmap and fault in up "
+		 "front) or lock (populate and mlock)",
+		 " default: heap"},
+		{NULL, 'H', POPT_ARG_STRING, &huge_pages, 0,
+		 "back the arena cache with huge pages: thp (transparent) or "
+		 "hugetlb (reserved, or else thp)", " default: small pages"},
+		{NULL, 'i', POPT_ARG_STRING, &watch_dir, 0,
+		 "drop cached files under this directory when they change, "
+		 "using inotify", " default: cached files are never checked"},
+		{NULL, 'z', POPT_ARG_INT, &gzip_level, 0,
+		 "also cache a gzip variant of each file, compressed at this "
+		 "level (1-9), for the clients that accept it",
+		 " default: 0 (off)"},
+		{NULL, 'Z', POPT_ARG_NONE, &gzip_only, 0,
+		 "cache only the gzip variant of the files that compress, "
+		 "implies -z 6", NULL},
+		{NULL, 'K', POPT_ARG_INT, &keepalive_ms, 0,
+		 "keep connections that ask for it open for more requests "
+		 "until they are idle for this many ms, 0 to close them after "
+		 "each response", " default: 1000"},
+		{NULL, 'u', POPT_ARG_STRING, &unix_path, 0,
+		 "also listen on a unix domain socket at this path, or only "
+		 "there with port 0", " default: tcp only"},
+		{NULL, 'D', POPT_ARG_INT, &dequeue_batch, 0,
+		 "workers take up to this many queued connections (at most 64) "
+		 "each time they take the queue lock", " default: 1"},
+		{NULL, 'T', POPT_ARG_STRING, &adapt_threads, 0,
+		 "grow and shrink the pool of worker threads between min:max "
+		 "with the queue depth, the time workers are blocked on the "
+		 "disk and the cpu utilization", " default: fixed"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
 
-	if (argc != 5)
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	for (i = 0; i < 4; i++) {
+		if ((args[i] = poptGetArg(context)) == NULL)
+			usage(argv[0]);
+	}
+	if (poptGetArg(context) != NULL)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
-	if (port < 1024) {
-		fprintf(stderr, "port = %d, should be >= 1024\n", port);
+	port = atoi(args[0]);
+	nr_threads = atoi(args[1]);
+	max_requests = atoi(args[2]);
+	max_cache_size = atoi(args[3]);
+	if (port < 1024 && !(port == 0 && unix_path)) {
+		fprintf(stderr, "port = %d, should be >= 1024, or 0 with -u\n",
+			port);
 		usage(argv[0]);
 	}
 	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+	if (codel_target < 0 || retry_after < 0) {
+		fprintf(stderr, "shedding options should be >= 0\n");
+		usage(argv[0]);
+	}
+	if ((strcmp(queue_order, "fifo") && strcmp(queue_order, "sjf")) ||
+	    sjf_aging < 0) {
+		fprintf(stderr, "queue order should be fifo or sjf, with "
+			"aging >= 0\n");
+		usage(argv[0]);
+	}
+	if (dequeue_batch < 1 || dequeue_batch > 64) {
+		fprintf(stderr, "dequeue batch should be between 1 and 64\n");
+		usage(argv[0]);
+	}
+	if (adapt_threads &&
+	    (sscanf(adapt_threads, "%d:%d", &adapt_min, &adapt_max) != 2 ||
+	     adapt_min < 1 || adapt_max < adapt_min || nr_threads == 0 ||
+	     max_requests == 0)) {
+		fprintf(stderr, "adaptive threads should be min:max, with "
+			"1 <= min <= max, and need threads and a queue\n");
+		usage(argv[0]);
+	}
+	if (keepalive_ms < 0) {
+		fprintf(stderr, "keep-alive time should be >= 0\n");
+		usage(argv[0]);
+	}
+	if (gzip_only && gzip_level == 0)
+		gzip_level = 6;
+	if (gzip_level < 0 || gzip_level > 9) {
+		fprintf(stderr, "gzip level should be between 0 and 9\n");
+		usage(argv[0]);
+	}
+	if (huge_pages) {
+		if (strcmp(huge_pages, "thp") == 0) {
+			slab_flags = SLAB_HUGE;
+		} else if (strcmp(huge_pages, "hugetlb") == 0) {
+			slab_flags = SLAB_HUGETLB;
+		} else {
+			fprintf(stderr, "huge pages should be thp or hugetlb\n");
+			usage(argv[0]);
+		}
+		if (strcmp(cache_backend, "arena") != 0) {
+			fprintf(stderr, "huge pages need -k arena\n");
+			usage(argv[0]);
+		}
+	}
 
 	sv = server_init(nr_threads, max_requests, max_cache_size);
+	if (shed || codel_target > 0)
+		server_set_shedding(sv, codel_target, retry_after);
+	if (strcmp(cache_backend, "heap") == 0) {
+		map_flags = 0;
+	} else if (strcmp(cache_backend, "arena") == 0) {
+		map_flags = 0;
+		server_set_cache_arena(sv, slab_flags);
+	} else if (strcmp(cache_backend, "mmap") == 0) {
+		map_flags = REQUEST_MAP;
+	} else if (strcmp(cache_backend, "populate") == 0) {
+		map_flags = REQUEST_MAP | REQUEST_MAP_POPULATE;
+	} else if (strcmp(cache_backend, "lock") == 0) {
+		map_flags = REQUEST_MAP | REQUEST_MAP_POPULATE |
+			REQUEST_MAP_LOCK;
+	} else {
+		fprintf(stderr, "unknown cache backend: %s\n", cache_backend);
+		usage(argv[0]);
+	}
+	if (map_flags)
+		server_set_cache_map(sv, map_flags);
+	if (gzip_level > 0)
+		server_set_cache_gzip(sv, gzip_level, gzip_only);
+	if (strcmp(queue_order, "sjf") == 0)
+		server_set_sjf(sv, sjf_aging);
+	if (stream_size >= 0)
+		server_set_stream_size(sv, stream_size);
+	server_set_keepalive(sv, keepalive_ms);
+	if (dequeue_batch > 1)
+		server_set_dequeue_batch(sv, dequeue_batch);
+	if (worker_cpus || acceptor_cpus)
+		server_pin(sv, worker_cpus, acceptor_cpus);
+	if (adapt_threads)
+		server_set_adaptive(sv, adapt_min, adapt_max);
+	if (watch_dir)
+		server_watch(sv, watch_dir);
+	if (warmup_index)
+		server_warmup(sv, warmup_index);
 
-	listenfd = open_listenfd(port);
+	/* a negative fd is left out of the poll. the listening sockets are
+	 * non-blocking, so that all the waiting connections can be accepted
+	 * on one wakeup */
+	listenfd = port > 0 ? open_listenfd(port) : -1;
+	if (listenfd >= 0)
+		SYS(fcntl(listenfd, F_SETFL, O_NONBLOCK));
+	if (unix_path) {
+		unixfd = open_unix_listenfd(unix_path);
+		SYS(fcntl(unixfd, F_SETFL, O_NONBLOCK));
+	}
 	exitfd = open_fifo();
 
 	struct pollfd fds[] = {
 		{exitfd, POLLIN},
 		{listenfd, POLLIN},
+		{unixfd, POLLIN},
+		{server_idle_fd(sv), POLLIN},
 	};
 	while (1) {
-		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
+		/* wait for either a client to connect, a request on an idle
+		 * connection, or an exit event */
+		SYS(poll(fds, 4, timeout));
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) { /* a command */
+			if (read_fifo(&exitfd, sv))	/* exit requested */
+				break;
+			fds[0].fd = exitfd;
 		}
 
-		assert(fds[1].revents & POLLIN); /* connect request arrived */
-		clientlen = sizeof(clientaddr);
-		/* connfd is the socket descriptor the server will use to send
-		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
+		for (i = 1; i < 3; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			/* connect requests arrived. connfd is the socket
+			 * descriptor the server will use to send data to the
+			 * client. it stays blocking, since the workers block
+			 * on it. */
+			nr = 0;
+			while (nr < ACCEPT_BATCH &&
+			       (connfd = accept4(fds[i].fd, NULL, NULL,
+						 SOCK_CLOEXEC)) >= 0) {
+				batch[nr++] = connfd;
+			}
+			/* running out of fds or memory in a burst is
+			 * transient, the workers close connections as they
+			 * finish them */
+			backoff = nr < ACCEPT_BATCH &&
+				(errno == EMFILE || errno == ENFILE ||
+				 errno == ENOBUFS || errno == ENOMEM);
+			if (nr < ACCEPT_BATCH && !backoff && errno != EAGAIN &&
+			    errno != EWOULDBLOCK && errno != EINTR &&
+			    errno != ECONNABORTED)
+				unix_error("accept4");
+
+			/* serve the requests */
+			server_request_batch(sv, batch, nr);
+			if (backoff)	/* the listener stays readable */
+				usleep(ACCEPT_BACKOFF);
+		}
 
-		/* serve the request */
-		server_request(sv, connfd);
+		/* queue the idle connections with a new request, and close
+		 * those that timed out */
+		timeout = server_idle(sv);
 	}
 
 	close_fifo();
+	if (unix_path)
+		unlink(unix_path);
 	server_exit(sv);
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
@@ -1,44 +1,213 @@
 // original
+#define _GNU_SOURCE  // for the cpu affinity functions
 #include "server_thread.h"
 
 #include "common.h"
+#include "fileidx.h"
 #include "request.h"
+#include "slab.h"
 
 // added
+#include <dirent.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 
 //# Self-defined Structures
+struct server_stats {  // counters reported when the server exits
+    long requests;  // requests handled
+    long connections;  // connections accepted, each with one or more requests
+    long pipelined;  // requests that had arrived before the previous response was sent
+    long resumed;  // idle connections queued again for their next request
+    long idle_timeouts;  // idle connections closed after keepalive_ms
+    long errors;  // requests that got an error response
+    long bytes;  // file bytes sent
+    long not_modified;  // requests answered with a 304, the client had the file
+    long ranged;  // requests for parts of a file, with a Range header
+    long accept_batches;  // times the acceptor queued the connections it accepted at once
+    long queue_waits;  // times the acceptor waited for a full queue
+    long dequeues;  // times a worker took connections off the queue
+    long blocked_us;  // time workers were blocked reading files, not on the cpu
+    long pool_grows;  // times the adaptive pool grew
+    long pool_shrinks;
+    long shed_full;  // requests shed because the queue was full
+    long shed_codel;  // requests shed because they waited too long
+    long sjf_unknown;  // requests served before their request line arrived
+    long streamed;  // requests for large files that were streamed
+    long stream_changed;  // streamed files that changed on disk while being sent
+    long meta_hits;  // streamed files whose checksum was known
+    long meta_misses;
+    long cache_hits;
+    long cache_misses;
+    long cache_inserts;
+    long cache_evictions;
+    long cache_compressed;  // files cached with a gzip variant
+    long compressed;  // responses with the gzip variant of a file
+    long invalidations;  // cached files and metadata dropped because a file changed
+    long watch_overflows;  // times inotify lost events, and everything was dropped
+};
+
+// CoDel (RFC 8289) applied to the request queue: once requests have waited
+// longer than target for a whole interval, shed them at a rate that grows with
+// the square root of the number shed, until the wait drops below target
+#define CODEL_INTERVAL 100000  // us
+
+struct codel {
+    long target;  // us, 0 to disable
+    long first_above;  // time at which the wait is persistently high, 0 if below target
+    long drop_next;  // time of the next shed
+    int count;  // sheds since entering the dropping state
+    bool dropping;
+};
+
+// shortest job first: queued requests are ordered by arrival time + aging *
+// expected service time, so a short request can overtake a long one that
+// arrived at most aging * (difference in service time) earlier. this bounds
+// the extra wait of long requests, unlike pure SJF. connections are usually
+// accepted before their request arrives, so a request that can't be looked at
+// when it is queued is looked at again when a worker takes it, outside the
+// queue lock since that takes a stat, and put back in its place.
+#define SJF_NS_PER_BYTE 256  // cost of request_processfile's 128 passes
+#define SJF_MISS_US 10000  // cost of reading a file, see request_readfile
+
+struct queued {  // a request in the SJF queue
+    int connfd;
+    long key;  // smallest key is served first
+    long time;  // enqueue time
+    long arrival;  // us
+    bool known;  // key includes the expected service time
+};
+
 struct server {
     int nr_threads;  // number of worker threads
+    int nr_retiring;  // workers asked to exit, see server_set_threads
+    int nr_idle;  // workers waiting for the queue to fill
+    int adapt_min;  // bounds of the adaptive worker pool, 0 if it is fixed
+    int adapt_max;
+    pthread_t adapt_thread;
     int max_requests;  // buffer size
+    int queue_slots;  // size of the queue arrays, at least max_requests
     int exiting;  // server state is exiting
     int max_cache_size;  // for lab 5
 
     /* add any other parameters you need */
     int num_requests;  // number of requests in the buffer = in - out
     int *request_buffer;
+    long *request_times;  // enqueue time of each request, for CoDel
+    bool shed;  // shed load with 503 responses instead of waiting on a full queue
+    struct codel codel;
+    struct queued *sjf_heap;  // min-heap on key, replaces request_buffer for SJF
+    double sjf_aging;
+    long stream_size;  // stream files larger than this, 0 to never stream
+    bool stream_size_set;  // by server_set_stream_size, else it follows the cache size
+    int keepalive_ms;  // keep idle connections open this long, 0 to close after each response
+    int idle_fd;  // epoll instance of the idle connections, -1 if none
+    struct idle *idle_head;  // idle for the longest time, closed first
+    struct idle *idle_tail;
+    int dequeue_batch;  // most connections a worker takes off the queue at once
+    int *worker_cpus;  // worker i runs on worker_cpus[i % nr_worker_cpus], NULL if not pinned
+    int nr_worker_cpus;
     pthread_t **worker_threads;  // worker thread table
+    int watch_fd;  // inotify instance of the watcher thread, -1 if none
+    char **watch_dirs;  // the directory of each watch descriptor, by wd
+    int nr_watch_dirs;
+    pthread_t watch_thread;
+    struct server_stats stats;
+};
+
+#define DEQUEUE_BATCH_MAX 64  // most connections a worker can take at once
+
+// workers update the counters concurrently
+#define STAT_ADD(sv, name, n) __sync_fetch_and_add(&(sv)->stats.name, (n))
+
+// the files in the cache are found through an open addressing hash table with
+// robin hood probing, sized by the number of files. it grows by moving a few
+// slots to a table of twice the size on each cache operation, so that no
+// single request pays for moving all the files.
+#define INDEX_MIN_SLOTS 64
+#define INDEX_MIGRATE 16  // nr of old slots moved per operation while growing
+#define CACHE_TRIM 4  // nr of files evicted per operation while over a reduced size
+
+struct slot {
+    unsigned int hash;  // full hash of the file name, 0 if the slot is empty
+    struct file *file;
+};
+
+struct index {
+    struct slot *slots;  // NULL for no table
+    unsigned int mask;  // nr of slots - 1
+    int nr;  // nr of files
 };
 
 struct cache_table {
     int currSize;
-    struct file **hash_table;
-    struct LRU *LRU;
+    struct index index;
+    struct index old_index;  // while growing, the files that haven't moved yet
+    unsigned int migrated;  // old_index slots before this one have moved
+    struct file *lru_head;  // most recently used
+    struct file *lru_tail;  // evicted first
+    int map_flags;  // REQUEST_MAP flags, 0 to keep file data on the heap
+    struct slab_arena *arena;  // where file data is kept, NULL for the heap
+    int gzip_level;  // compress cached files at this zlib level, 0 to not
+    bool gzip_only;  // keep only the gzip variant of files that compress
+    // incremented whenever files are invalidated, so that a file that was read
+    // before it changed isn't inserted after it was invalidated
+    unsigned long generation;
 };
 
 struct file {  // list of file
     struct file_data *data;
-    struct file *next;
+    unsigned int hash;
+    struct file *lru_prev;
+    struct file *lru_next;
+    // one reference for the cache, and one for each request sending the file,
+    // so that an evicted file is freed when its last request is done
+    int refs;
+    int size;  // bytes counted against the cache, for both variants
+    bool in_arena;  // data->file_buf and data->gzip_buf are in cache_table->arena
 };
 
-struct LRU {  // list of files name and index, only keep the name of the file
-    struct LRU *next;
+struct cache_table *cache_table;
+
+// metadata of the files that were streamed, so that the checksum that is sent
+// in the header only has to be computed again when a file changes
+#define META_BUCKETS 4096
+#define STREAM_CHUNK (64 * 1024)  // size of the per-worker buffer for streaming
+
+struct meta {
     char *name;
-    int size;
+    long size;
+    struct timespec mtime;
+    unsigned int csum;
+    struct meta *next;
 };
 
-struct cache_table *cache_table;
+struct meta *meta_table[META_BUCKETS];
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a connection that is kept open waits for its next request in the acceptor's
+// poll set, not on a worker. a worker serves the requests that the client
+// pipelined, and then hands the connection to the acceptor, which queues it
+// again once it is readable, or closes it once it was idle for keepalive_ms.
+// connections become idle in the order they are closed in, so the list of
+// them is kept in that order.
+#define IDLE_BATCH 64  // most idle connections the acceptor looks at on one wakeup
+
+struct idle {
+    int fd;
+    long since;  // us
+    struct idle *prev;
+    struct idle *next;
+};
+
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread char *stream_buf;
+static __thread int schedstat_fd = -2;  // see thread_run_us, -1 if there is none
 
 //# Global Variables
 pthread_mutex_t lock;
@@ -54,18 +223,47 @@ int MAX_CACHE_SIZE = 0;
 
 
 //# static functions
-int hashFunction(char *word);
+static long now_us(void);
+static long thread_run_us(void);
+unsigned int hashFunction(char *word);
 static struct file_data *file_data_init(void);
 static void file_data_free(struct file_data *data);
 
-int hashFunction(char *word) {  //* map a file name to a index
+unsigned int hashFunction(char *word) {  //* map a file name to a hash, never 0
     unsigned long hash = 5381;
     int c              = 0;
 
     while ((c = *word++) != '\0')
         hash = ((hash << 5) + hash) + c;
 
-    return hash % MAX_CACHE_SIZE;
+    hash ^= hash >> 32;
+    return hash ? hash : 1;
+}
+
+static long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// time the calling thread was on a cpu or waiting for one, so that the rest
+// of the time it was blocked. without schedstat, only the cpu time is known.
+static long thread_run_us(void) {
+    char buf[128];
+    unsigned long long on_cpu, waiting;
+    struct timespec ts;
+    ssize_t n;
+
+    if (schedstat_fd == -2)
+        schedstat_fd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+    if (schedstat_fd >= 0 && (n = pread(schedstat_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        if (sscanf(buf, "%llu %llu", &on_cpu, &waiting) == 2)
+            return (on_cpu + waiting) / 1000;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
 }
 
 /* initialize file data */
@@ -76,154 +274,1268 @@ static struct file_data *file_data_init(void) {
     data->file_name = NULL;
     data->file_buf  = NULL;
     data->file_size = 0;
+    data->file_mapped = 0;
+    data->file_mtime  = 0;
+    data->gzip_buf    = NULL;
+    data->gzip_size   = 0;
+    data->file_csum   = 0;
     return data;
 }
 
 /* free all file data */
 static void file_data_free(struct file_data *data) {
     free(data->file_name);
-    free(data->file_buf);
+    request_freedata(data);
     free(data);
 }
 
-//# cache functions
-void LRUAdd(struct file_data *data);
-struct file *cacheLookup(char *word);
+//# cache index functions, called with the cache lock held
+static void index_init(struct index *t, unsigned int nr_slots);
+static unsigned int index_dib(struct index *t, unsigned int pos);
+static int index_find(struct index *t, unsigned int hash, char *fileName);
+static void index_add(struct index *t, struct file *f);
+static void index_delete(struct index *t, unsigned int pos);
+static void index_migrate(int nr_slots);
+static void index_grow(void);
+
+static void index_init(struct index *t, unsigned int nr_slots) {
+    t->slots = (struct slot *)calloc(nr_slots, sizeof(struct slot));
+    if (t->slots == NULL)
+        unix_error("calloc");
+    t->mask = nr_slots - 1;
+    t->nr   = 0;
+}
 
+// distance of the file in slot pos from the slot it hashes to
+static unsigned int index_dib(struct index *t, unsigned int pos) {
+    return (pos - t->slots[pos].hash) & t->mask;
+}
+
+// returns the slot of fileName, or -1
+static int index_find(struct index *t, unsigned int hash, char *fileName) {
+    if (t->slots == NULL)
+        return -1;
+
+    for (unsigned int pos = hash & t->mask, dib = 0;; pos = (pos + 1) & t->mask, dib++) {
+        struct slot *slot = &t->slots[pos];
+        // a file is never further from its slot than the files it passed
+        if (slot->hash == 0 || index_dib(t, pos) < dib)
+            return -1;
+        if (slot->hash == hash && strcmp(slot->file->data->file_name, fileName) == 0)
+            return pos;
+    }
+}
+
+static void index_add(struct index *t, struct file *f) {
+    struct slot add = {f->hash, f};
+
+    for (unsigned int pos = f->hash & t->mask, dib = 0;; pos = (pos + 1) & t->mask, dib++) {
+        struct slot *slot = &t->slots[pos];
+        if (slot->hash == 0) {
+            *slot = add;
+            t->nr++;
+            return;
+        }
+        if (index_dib(t, pos) < dib) {  // take the slot from a file closer to its own
+            struct slot tmp = *slot;
+            dib             = index_dib(t, pos);
+            *slot           = add;
+            add             = tmp;
+        }
+    }
+}
 
-void LRUAdd(struct file_data *data) {
-    if (cache_table->LRU == NULL)
-        cache_table->LRU = (struct LRU *)malloc(sizeof(struct LRU));
+// remove the file in slot pos, and shift back the files after it
+static void index_delete(struct index *t, unsigned int pos) {
+    unsigned int next;
 
-    cache_table->LRU->size = data->file_size;
-    cache_table->LRU->next = NULL;
-    cache_table->LRU->name = strdup(data->file_name);
-    cache_table->LRU->next = NULL;
-    return;
+    while (t->slots[next = (pos + 1) & t->mask].hash != 0 && index_dib(t, next) > 0) {
+        t->slots[pos] = t->slots[next];
+        pos           = next;
+    }
+    t->slots[pos].hash = 0;
+    t->slots[pos].file = NULL;
+    t->nr--;
+}
+
+// move up to nr_slots slots of the old index to the index. deleting the file
+// in a slot shifts the rest of its run back into it, so the slot is done when
+// it is empty. the files left in the old index then all hash to later slots,
+// and can still be found.
+static void index_migrate(int nr_slots) {
+    struct index *old = &cache_table->old_index;
+
+    while (old->slots && nr_slots-- > 0) {
+        struct slot *slot = &old->slots[cache_table->migrated];
+        while (slot->hash != 0) {
+            index_add(&cache_table->index, slot->file);
+            index_delete(old, cache_table->migrated);
+        }
+        if (++cache_table->migrated > old->mask) {
+            assert(old->nr == 0);
+            free(old->slots);
+            old->slots = NULL;
+        }
+    }
+}
+
+// make room for one more file, keeping the index at most 3/4 full
+static void index_grow(void) {
+    struct index *t = &cache_table->index;
+
+    if ((t->nr + cache_table->old_index.nr + 1) * 4 <= (t->mask + 1) * 3)
+        return;
+    index_migrate(INT_MAX);  // finish the last time it grew
+    cache_table->old_index = *t;
+    cache_table->migrated  = 0;
+    index_init(t, (t->mask + 1) * 2);
+}
+
+//# cache functions, called with the cache lock held
+static void lru_add(struct file *f);
+static void lru_remove(struct file *f);
+struct file *cacheLookup(char *word);
+static struct file *cache_get(char *fileName);
+static void cache_put(struct file *f);
+static void cache_remove(struct file *f);
+bool cache_evict(struct server *sv, int fileSize);
+static void cache_trim(struct server *sv, int nr_files);
+static char *cache_alloc(struct server *sv, int fileSize);
+static int cache_size(struct file_data *data);
+static void cache_compress(struct file_data *data);
+struct file *cache_insert(struct server *sv, struct file_data *data);
+static int cache_invalidate(char *prefix, bool subtree);
+static void cache_free(void);
+
+static void lru_add(struct file *f) {  // add at the head
+    f->lru_prev = NULL;
+    f->lru_next = cache_table->lru_head;
+    if (cache_table->lru_head)
+        cache_table->lru_head->lru_prev = f;
+    else
+        cache_table->lru_tail = f;
+    cache_table->lru_head = f;
+}
+
+static void lru_remove(struct file *f) {
+    if (f->lru_prev)
+        f->lru_prev->lru_next = f->lru_next;
+    else
+        cache_table->lru_head = f->lru_next;
+    if (f->lru_next)
+        f->lru_next->lru_prev = f->lru_prev;
+    else
+        cache_table->lru_tail = f->lru_prev;
 }
 
 struct file *cacheLookup(char *fileName) {
-    int hash = hashFunction(fileName);  // turn file name into an int to find in hashtable
+    unsigned int hash = hashFunction(fileName);  // compared before the names
+    int pos;
 
-    if (cache_table->hash_table[hash] == NULL)
-        return NULL;
+    index_migrate(INDEX_MIGRATE);
+    if ((pos = index_find(&cache_table->index, hash, fileName)) >= 0)
+        return cache_table->index.slots[pos].file;
+    if ((pos = index_find(&cache_table->old_index, hash, fileName)) >= 0)
+        return cache_table->old_index.slots[pos].file;
 
-    struct file *current = cache_table->hash_table[hash];
+    return NULL;
+}
 
-    while (current) {  //* traverse the linked list
-        if (strcmp(current->data->file_name, fileName) == 0)
-            return current;
-        else
-            current = current->next;
+// look up a file to send, making it the most recently used. the caller holds a
+// reference to the file until it calls cache_put.
+static struct file *cache_get(char *fileName) {
+    struct file *f = cacheLookup(fileName);
+
+    if (f) {
+        lru_remove(f);
+        lru_add(f);
+        f->refs++;
     }
+    return f;
+}
 
-    return NULL;
+static void cache_put(struct file *f) {
+    if (--f->refs > 0)
+        return;
+    if (f->in_arena) {
+        if (f->data->file_buf)
+            slab_free(cache_table->arena, f->data->file_buf);
+        if (f->data->gzip_buf)
+            slab_free(cache_table->arena, f->data->gzip_buf);
+        f->data->file_buf = NULL;
+        f->data->gzip_buf = NULL;
+    }
+    file_data_free(f->data);
+    free(f);
 }
 
-bool cache_evict(int fileSize) {
-    int freedSize    = 0;
-    int sizeOverflow = cache_table->currSize + fileSize - MAX_CACHE_SIZE;
+static void cache_remove(struct file *f) {
+    int pos = index_find(&cache_table->index, f->hash, f->data->file_name);
+
+    if (pos >= 0) {
+        index_delete(&cache_table->index, pos);
+    } else {
+        pos = index_find(&cache_table->old_index, f->hash, f->data->file_name);
+        assert(pos >= 0);
+        index_delete(&cache_table->old_index, pos);
+    }
+    lru_remove(f);
+    cache_table->currSize -= f->size;
+    cache_put(f);  // the cache's reference
+}
 
-    if (cache_table->LRU && freedSize < sizeOverflow) {
-        freedSize = cache_table->LRU->size;
-        cache_table->LRU = NULL;
+// evict least recently used files until fileSize more bytes fit in the cache
+bool cache_evict(struct server *sv, int fileSize) {
+    while (cache_table->currSize + fileSize > MAX_CACHE_SIZE && cache_table->lru_tail) {
+        cache_remove(cache_table->lru_tail);
+        STAT_ADD(sv, cache_evictions, 1);
     }
 
-    if (freedSize >= sizeOverflow)
+    if (cache_table->currSize + fileSize <= MAX_CACHE_SIZE)
         return true;
     else
         return false;
 }
 
-struct file *cache_insert(const struct file_data *data) {
-    if (data->file_size > MAX_CACHE_SIZE)
+// evict up to nr_files least recently used files while the cache is larger
+// than its size, after server_set_cache_size reduced it. this is spread over
+// the cache operations, so that no single request pays for all the evictions.
+static void cache_trim(struct server *sv, int nr_files) {
+    while (cache_table->currSize > MAX_CACHE_SIZE && cache_table->lru_tail && nr_files-- > 0) {
+        cache_remove(cache_table->lru_tail);
+        STAT_ADD(sv, cache_evictions, 1);
+    }
+}
+
+// allocate fileSize bytes from the arena, evicting least recently used files
+// until they fit. an evicted file that is still being sent keeps its memory
+// until it is done, so this can fail even when the cache is empty.
+static char *cache_alloc(struct server *sv, int fileSize) {
+    char *buf;
+
+    if (fileSize > MAX_CACHE_SIZE)
         return NULL;
+    while ((buf = slab_alloc(cache_table->arena, fileSize)) == NULL && cache_table->lru_tail) {
+        cache_remove(cache_table->lru_tail);
+        STAT_ADD(sv, cache_evictions, 1);
+    }
+    return buf;
+}
 
-    if (cache_table->currSize + data->file_size > MAX_CACHE_SIZE) {
+// the bytes of data that count against the cache: the file and its gzip
+// variant, or only one of them
+static int cache_size(struct file_data *data) {
+    return (data->file_buf ? data->file_size : 0) + (data->gzip_buf ? data->gzip_size : 0);
+}
+
+// add a gzip variant to file data that is about to be cached, if the cache
+// keeps them. this is done before taking the cache lock, since it is slow.
+static void cache_compress(struct file_data *data) {
+    if (cache_table->gzip_level > 0)
+        request_gzipdata(data, cache_table->gzip_level, !cache_table->gzip_only);
+}
+
+// the cache takes over the file data in data, which is left without it
+struct file *cache_insert(struct server *sv, struct file_data *data) {
+    int size = cache_size(data);
+
+    if (size > MAX_CACHE_SIZE)
+        return NULL;
+    if (cache_table->currSize > MAX_CACHE_SIZE)  // still shrinking, see cache_trim
+        return NULL;
+
+    if (cache_table->arena) {  // the arena decides what fits
+        char *buf = NULL, *gzip_buf = NULL;
+        int gzip_size = data->gzip_size;
+
+        if (data->file_buf && (buf = cache_alloc(sv, data->file_size)) == NULL)
+            return NULL;
+        if (data->gzip_buf && (gzip_buf = cache_alloc(sv, gzip_size)) == NULL) {
+            if (buf)
+                slab_free(cache_table->arena, buf);
+            return NULL;
+        }
+        if (buf)
+            memcpy(buf, data->file_buf, data->file_size);
+        if (gzip_buf)
+            memcpy(gzip_buf, data->gzip_buf, gzip_size);
+        request_freedata(data);
+        data->file_buf  = buf;
+        data->gzip_buf  = gzip_buf;
+        data->gzip_size = gzip_size;
+    } else if (cache_table->currSize + size > MAX_CACHE_SIZE) {
         // spare space for this insert
-        if (!cache_evict(data->file_size))  // if no space
+        if (!cache_evict(sv, size))  // if no space
             return NULL;
     }
 
-    struct file *file_to_cache     = (struct file *)malloc(sizeof(struct file));
-    file_to_cache->data            = file_data_init();
-    file_to_cache->data->file_name = strdup(data->file_name);
-    file_to_cache->data->file_buf  = strdup(data->file_buf);
-    file_to_cache->data->file_size = data->file_size;
+    struct file *file_to_cache       = (struct file *)malloc(sizeof(struct file));
+    file_to_cache->data              = file_data_init();
+    file_to_cache->data->file_name   = strdup(data->file_name);
+    file_to_cache->data->file_buf    = data->file_buf;  // no copy
+    file_to_cache->data->file_size   = data->file_size;
+    file_to_cache->data->file_mapped = data->file_mapped;
+    file_to_cache->data->file_mtime  = data->file_mtime;
+    file_to_cache->data->gzip_buf    = data->gzip_buf;
+    file_to_cache->data->gzip_size   = data->gzip_size;
+    file_to_cache->data->file_csum   = data->file_csum;
+    file_to_cache->hash              = hashFunction(data->file_name);
+    file_to_cache->refs              = 1;
+    file_to_cache->size              = size;
+    file_to_cache->in_arena          = cache_table->arena != NULL;
+    data->file_buf                   = NULL;
+    data->file_mapped                = 0;
+    data->gzip_buf                   = NULL;
+    data->gzip_size                  = 0;
+
+    cache_table->currSize = cache_table->currSize + size;
+    lru_add(file_to_cache);
+
+    index_grow();
+    index_add(&cache_table->index, file_to_cache);
+
+    STAT_ADD(sv, cache_inserts, 1);
+    if (file_to_cache->data->gzip_buf)
+        STAT_ADD(sv, cache_compressed, 1);
+    return file_to_cache;
+}
 
-    file_to_cache->next = NULL;
+// remove the file named prefix, or with subtree, all the files under the
+// directory named prefix. returns the nr of files removed.
+static int cache_invalidate(char *prefix, bool subtree) {
+    struct file *f, *next;
+    size_t len = strlen(prefix);
+    int nr     = 0;
+
+    cache_table->generation++;
+    if (!subtree) {
+        if ((f = cacheLookup(prefix)) == NULL)
+            return 0;
+        cache_remove(f);
+        return 1;
+    }
+    for (f = cache_table->lru_head; f; f = next) {
+        next = f->lru_next;
+        if (strncmp(f->data->file_name, prefix, len) == 0 && f->data->file_name[len] == '/') {
+            cache_remove(f);
+            nr++;
+        }
+    }
+    return nr;
+}
 
-    cache_table->currSize = cache_table->currSize + data->file_size;
-    int hash              = hashFunction(data->file_name);
-    LRUAdd(file_to_cache->data);
+static void cache_free(void) {
+    while (cache_table->lru_head)
+        cache_remove(cache_table->lru_head);
+    free(cache_table->index.slots);
+    free(cache_table->old_index.slots);
+    if (cache_table->arena)
+        slab_arena_destroy(cache_table->arena);
+    free(cache_table);
+}
 
-    if (cache_table->hash_table[hash] == NULL)  // null node
-        cache_table->hash_table[hash] = file_to_cache;
+//# load shedding functions
+static bool codel_ok_to_drop(struct codel *c, long sojourn, long now);
+static long codel_control_law(struct codel *c, long t);
+static bool codel_dequeue(struct codel *c, long sojourn, long now);
 
-    return file_to_cache;
+static bool codel_ok_to_drop(struct codel *c, long sojourn, long now) {
+    if (sojourn < c->target) {
+        c->first_above = 0;
+        return false;
+    }
+    if (c->first_above == 0) {  // give the queue an interval to drain
+        c->first_above = now + CODEL_INTERVAL;
+        return false;
+    }
+    return now >= c->first_above;
+}
+
+static long codel_control_law(struct codel *c, long t) {
+    return t + CODEL_INTERVAL / sqrt(c->count);
+}
+
+// called with the queue lock held for each request that is dequeued, returns
+// true if the request should be shed
+static bool codel_dequeue(struct codel *c, long sojourn, long now) {
+    bool ok_to_drop = codel_ok_to_drop(c, sojourn, now);
+
+    if (c->dropping) {
+        if (!ok_to_drop) {
+            c->dropping = false;
+            return false;
+        }
+        if (now < c->drop_next)
+            return false;
+        c->count++;
+        c->drop_next = codel_control_law(c, c->drop_next);
+        return true;
+    }
+    if (!ok_to_drop)
+        return false;
+
+    c->dropping = true;
+    // if we were dropping recently, resume close to the last rate
+    if (c->count > 2 && now - c->drop_next < 8 * CODEL_INTERVAL)
+        c->count -= 2;
+    else
+        c->count = 1;
+    c->drop_next = codel_control_law(c, now);
+    return true;
+}
+
+//# metadata functions
+static unsigned int meta_hash(char *name);
+static bool meta_lookup(char *name, struct stat *sbuf, unsigned int *csum);
+static long meta_size(char *name);
+static void meta_insert(char *name, struct stat *sbuf, unsigned int csum);
+static int meta_invalidate(char *prefix, bool subtree);
+static void meta_free(void);
+
+static unsigned int meta_hash(char *name) {
+    unsigned long hash = 5381;
+    int c              = 0;
+
+    while ((c = *name++) != '\0')
+        hash = ((hash << 5) + hash) + c;
+
+    return hash % META_BUCKETS;
+}
+
+// returns true and fills csum if name is known and hasn't changed since
+static bool meta_lookup(char *name, struct stat *sbuf, unsigned int *csum) {
+    bool found = false;
+
+    pthread_mutex_lock(&meta_lock);
+    for (struct meta *m = meta_table[meta_hash(name)]; m; m = m->next) {
+        if (strcmp(m->name, name) == 0) {
+            found = m->size == sbuf->st_size && m->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+                    m->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+            *csum = m->csum;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return found;
+}
+
+// the size of name when it was last streamed, -1 if it is not known. the file
+// is not looked at, so the size may be out of date.
+static long meta_size(char *name) {
+    long size = -1;
+
+    pthread_mutex_lock(&meta_lock);
+    for (struct meta *m = meta_table[meta_hash(name)]; m; m = m->next) {
+        if (strcmp(m->name, name) == 0) {
+            size = m->size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return size;
+}
+
+// add or update the metadata of name
+static void meta_insert(char *name, struct stat *sbuf, unsigned int csum) {
+    unsigned int hash = meta_hash(name);
+    struct meta *m;
+
+    pthread_mutex_lock(&meta_lock);
+    for (m = meta_table[hash]; m; m = m->next) {
+        if (strcmp(m->name, name) == 0)
+            break;
+    }
+    if (m == NULL) {
+        m                = (struct meta *)Malloc(sizeof(struct meta));
+        m->name          = strdup(name);
+        m->next          = meta_table[hash];
+        meta_table[hash] = m;
+    }
+    m->size  = sbuf->st_size;
+    m->mtime = sbuf->st_mtim;
+    m->csum  = csum;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// same as cache_invalidate, for the metadata
+static int meta_invalidate(char *prefix, bool subtree) {
+    size_t len = strlen(prefix);
+    int nr     = 0;
+
+    pthread_mutex_lock(&meta_lock);
+    for (int i = subtree ? 0 : meta_hash(prefix); i < META_BUCKETS; i++) {
+        struct meta **mp = &meta_table[i];
+        while (*mp) {
+            struct meta *m = *mp;
+            if (subtree ? strncmp(m->name, prefix, len) == 0 && m->name[len] == '/'
+                        : strcmp(m->name, prefix) == 0) {
+                *mp = m->next;
+                free(m->name);
+                free(m);
+                nr++;
+            } else {
+                mp = &m->next;
+            }
+        }
+        if (!subtree)
+            break;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return nr;
+}
+
+static void meta_free(void) {
+    for (int i = 0; i < META_BUCKETS; i++) {
+        while (meta_table[i]) {
+            struct meta *m = meta_table[i];
+            meta_table[i]  = m->next;
+            free(m->name);
+            free(m);
+        }
+    }
+}
+
+//# file watcher functions
+// the watcher thread follows changes to the files in a directory tree with
+// inotify, and drops the cached files and metadata of the files that change,
+// so that cache hits don't need a stat to find out whether a file is stale.
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_POLL_MS 100  // how often the watcher checks whether the server is exiting
+
+static void watch_add(struct server *sv, char *dir);
+static void watch_forget(struct server *sv, char *prefix);
+static void watch_invalidate(struct server *sv, char *name, bool subtree);
+static void watch_event(struct server *sv, struct inotify_event *ev);
+static void *watch_thread(void *arg);
+
+// watch dir and the directories below it
+static void watch_add(struct server *sv, char *dir) {
+    DIR *d;
+    struct dirent *e;
+    int wd;
+
+    if ((wd = inotify_add_watch(sv->watch_fd, dir, WATCH_MASK | IN_ONLYDIR)) < 0) {
+        fprintf(stderr, "inotify_add_watch: %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    if (wd >= sv->nr_watch_dirs) {
+        int n = sv->nr_watch_dirs ? sv->nr_watch_dirs : 64;
+        while (n <= wd)
+            n *= 2;
+        sv->watch_dirs = (char **)realloc(sv->watch_dirs, sizeof(char *) * n);
+        if (sv->watch_dirs == NULL)
+            unix_error("realloc");
+        memset(sv->watch_dirs + sv->nr_watch_dirs, 0, sizeof(char *) * (n - sv->nr_watch_dirs));
+        sv->nr_watch_dirs = n;
+    }
+    free(sv->watch_dirs[wd]);  // a directory can be watched again after a move
+    sv->watch_dirs[wd] = strdup(dir);
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    while ((e = readdir(d)) != NULL) {
+        char path[MAXLINE];
+        struct stat sbuf;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_type == DT_DIR || (e->d_type == DT_UNKNOWN && stat(path, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)))
+            watch_add(sv, path);
+    }
+    closedir(d);
+}
+
+// stop watching the directories under prefix, which has moved away
+static void watch_forget(struct server *sv, char *prefix) {
+    size_t len = strlen(prefix);
+
+    for (int wd = 0; wd < sv->nr_watch_dirs; wd++) {
+        char *dir = sv->watch_dirs[wd];
+        if (dir && strncmp(dir, prefix, len) == 0 && (dir[len] == '/' || dir[len] == '\0')) {
+            inotify_rm_watch(sv->watch_fd, wd);
+            free(dir);
+            sv->watch_dirs[wd] = NULL;
+        }
+    }
+}
+
+static void watch_invalidate(struct server *sv, char *name, bool subtree) {
+    int nr;
+
+    pthread_mutex_lock(&cache);
+    nr = sv->max_cache_size > 0 ? cache_invalidate(name, subtree) : 0;
+    pthread_mutex_unlock(&cache);
+    nr += meta_invalidate(name, subtree);
+    STAT_ADD(sv, invalidations, nr);
+}
+
+static void watch_event(struct server *sv, struct inotify_event *ev) {
+    char name[MAXLINE];
+    char *dir;
+
+    if (ev->mask & IN_Q_OVERFLOW) {  // any file may have changed
+        STAT_ADD(sv, watch_overflows, 1);
+        watch_invalidate(sv, ".", true);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= sv->nr_watch_dirs || (dir = sv->watch_dirs[ev->wd]) == NULL)
+        return;
+    if (ev->mask & IN_IGNORED) {  // the directory is gone
+        free(dir);
+        sv->watch_dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0)  // an event on the directory itself, its parent reports it
+        return;
+    snprintf(name, sizeof(name), "%s/%s", dir, ev->name);
+    if (!(ev->mask & IN_ISDIR)) {
+        watch_invalidate(sv, name, false);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watch_forget(sv, name);
+        watch_invalidate(sv, name, true);
+    } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // files that were there before it moved in may have been cached
+        // after a request for them failed, so drop those too
+        watch_add(sv, name);
+        watch_invalidate(sv, name, true);
+    }
+}
+
+static void *watch_thread(void *arg) {
+    struct server *sv = (struct server *)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!sv->exiting) {
+        struct pollfd pfd = {sv->watch_fd, POLLIN, 0};
+        ssize_t n;
+
+        if (poll(&pfd, 1, WATCH_POLL_MS) <= 0)
+            continue;
+        if ((n = read(sv->watch_fd, buf, sizeof(buf))) <= 0)
+            continue;
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            watch_event(sv, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+//# shortest job first functions
+static long sjf_service(struct server *sv, int connfd, bool acceptor);
+static void sjf_key(struct server *sv, struct queued *q, bool acceptor);
+static void sjf_push(struct server *sv, int n, struct queued q);
+static struct queued sjf_pop(struct server *sv, int n);
+static bool sjf_requeue(struct server *sv, struct queued *q);
+
+// expected service time of the request on connfd in us, -1 if it hasn't arrived.
+// the acceptor only looks in the cache and the metadata, without waiting for
+// the cache lock, and leaves the other requests unknown for a worker to stat,
+// see sjf_requeue.
+static long sjf_service(struct server *sv, int connfd, bool acceptor) {
+    char file_name[MAXLINE];
+    struct stat sbuf;
+    long size = -1;
+
+    if (!request_peek(connfd, file_name, MAXLINE))
+        return -1;
+    if (sv->max_cache_size > 0) {
+        if (acceptor ? pthread_mutex_trylock(&cache) == 0 : pthread_mutex_lock(&cache) == 0) {
+            struct file *f = cacheLookup(file_name);
+            if (f)
+                size = f->data->file_size;
+            pthread_mutex_unlock(&cache);
+        }
+        if (size >= 0)
+            return size * SJF_NS_PER_BYTE / 1000;
+    }
+    if (acceptor) {
+        size = meta_size(file_name);
+        return size >= 0 ? size * SJF_NS_PER_BYTE / 1000 + SJF_MISS_US : -1;
+    }
+    if (stat(file_name, &sbuf) < 0)  // the error response is quick
+        return 0;
+    return sbuf.st_size * SJF_NS_PER_BYTE / 1000 + SJF_MISS_US;
+}
+
+static void sjf_key(struct server *sv, struct queued *q, bool acceptor) {
+    long service = sjf_service(sv, q->connfd, acceptor);
+
+    q->known = service >= 0;
+    q->key   = q->arrival + (q->known ? sv->sjf_aging * service : 0);
+}
+
+// add q to the heap of n requests
+static void sjf_push(struct server *sv, int n, struct queued q) {
+    int i = n;
+
+    while (i > 0 && sv->sjf_heap[(i - 1) / 2].key > q.key) {  // sift up
+        sv->sjf_heap[i] = sv->sjf_heap[(i - 1) / 2];
+        i               = (i - 1) / 2;
+    }
+    sv->sjf_heap[i] = q;
+}
+
+// remove the first request from the heap of n requests
+static struct queued sjf_pop(struct server *sv, int n) {
+    struct queued top  = sv->sjf_heap[0];
+    struct queued last = sv->sjf_heap[--n];
+    int i              = 0;
+
+    while (2 * i + 1 < n) {  // sift down
+        int child = 2 * i + 1;
+        if (child + 1 < n && sv->sjf_heap[child + 1].key < sv->sjf_heap[child].key)
+            child++;
+        if (last.key <= sv->sjf_heap[child].key)
+            break;
+        sv->sjf_heap[i] = sv->sjf_heap[child];
+        i               = child;
+    }
+    sv->sjf_heap[i] = last;
+    return top;
+}
+
+// look again at a request that a worker took before its key was known, because
+// its request line hadn't arrived or the acceptor didn't know the file, without
+// the queue lock. returns true if it now has a key, and was put back in the
+// queue in its place. otherwise, it is served as a short request.
+static bool sjf_requeue(struct server *sv, struct queued *q) {
+    bool queued = false;
+
+    sjf_key(sv, q, false);
+    if (!q->known) {
+        STAT_ADD(sv, sjf_unknown, 1);
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    if (sv->num_requests < sv->queue_slots && !sv->exiting) {  // the acceptor may have filled it
+        sjf_push(sv, sv->num_requests, *q);
+        sv->num_requests += 1;
+        pthread_cond_signal(&empty);
+        queued = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return queued;
+}
+
+//# cpu placement functions
+static int cpu_topology(int cpu, const char *name);
+static int cpu_spread(int *cpus);
+static int cpu_parse_list(const char *list, int *cpus);
+static void cpu_pin(pthread_t thread, int *cpus, int nr_cpus);
+
+static int cpu_topology(int cpu, const char *name) {
+    char path[MAXLINE];
+    FILE *f;
+    int id = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &id) != 1)
+            id = -1;
+        fclose(f);
+    }
+    return id;
+}
+
+// fill cpus with the cpus that this process may run on, ordered so that
+// consecutive cpus are on different physical cores, and the hyperthread
+// siblings of a core only come after one cpu of every core. returns the count.
+static int cpu_spread(int *cpus) {
+    cpu_set_t set;
+    int package[CPU_SETSIZE], core[CPU_SETSIZE], rank[CPU_SETSIZE];
+    int n = 0;
+
+    SYS(sched_getaffinity(0, sizeof(set), &set));
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        package[n] = cpu_topology(cpu, "physical_package_id");
+        core[n]    = cpu_topology(cpu, "core_id");
+        rank[n]    = 0;  // nr of cpus on the same core before this one
+        for (int i = 0; i < n; i++) {
+            if (core[n] >= 0 && package[i] == package[n] && core[i] == core[n])
+                rank[n]++;
+        }
+        cpus[n++] = cpu;
+    }
+    // insertion sort on rank, then package, then core, then cpu
+    for (int i = 1; i < n; i++) {
+        int c = cpus[i], p = package[i], k = core[i], r = rank[i];
+        int j = i - 1;
+        while (j >= 0 && (rank[j] > r || (rank[j] == r && (package[j] > p || (package[j] == p && core[j] > k))))) {
+            cpus[j + 1] = cpus[j], package[j + 1] = package[j];
+            core[j + 1] = core[j], rank[j + 1] = rank[j];
+            j--;
+        }
+        cpus[j + 1] = c, package[j + 1] = p, core[j + 1] = k, rank[j + 1] = r;
+    }
+    return n;
+}
+
+// parse a list such as "0,2,4-7" into cpus, exits if it is malformed
+static int cpu_parse_list(const char *list, int *cpus) {
+    const char *p = list;
+    int n         = 0;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if (end == p)
+            goto bad;
+        last = first;
+        if (*end == '-') {
+            p    = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                goto bad;
+        }
+        if (first < 0 || last >= CPU_SETSIZE || first > last)
+            goto bad;
+        for (long cpu = first; cpu <= last && n < CPU_SETSIZE; cpu++)
+            cpus[n++] = cpu;
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            goto bad;
+    }
+    if (n > 0)
+        return n;
+bad:
+    fprintf(stderr, "bad cpu list: %s\n", list);
+    exit(1);
+}
+
+static void cpu_pin(pthread_t thread, int *cpus, int nr_cpus) {
+    cpu_set_t set;
+    int ret;
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < nr_cpus; i++)
+        CPU_SET(cpus[i], &set);
+    if ((ret = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0) {
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(ret));
+        exit(1);
+    }
+}
+
+//# adaptive worker pool functions
+// every ADAPT_INTERVAL, the pool grows when requests wait in the queue and
+// either the cpus have time left for more workers, or the workers spend much
+// of their time blocked on the disk, which more of them can overlap. it
+// shrinks when workers sit idle while the queue is empty, or when the cpus are
+// saturated by more workers than cpus that hardly block, since more of them
+// then only add context switches. a change needs the same verdict for a few
+// intervals in a row, more of them to shrink than to grow, so that the pool
+// doesn't thrash.
+#define ADAPT_INTERVAL 200  // ms
+#define ADAPT_GROW_STREAK 2  // intervals in a row that call for more workers
+#define ADAPT_SHRINK_STREAK 10  // intervals in a row that call for fewer workers
+#define ADAPT_BLOCKED 0.2  // share of the workers' time blocked on the disk that calls for more of them
+#define ADAPT_CPU_HIGH 0.9  // share of the cpus' time used by the server when they are saturated
+
+struct adapt_sample {
+    long time;  // us
+    long cpu;  // us used by the server
+    long blocked;  // us workers were blocked, see blocked_disk
+    long waits;  // times the acceptor found the queue full
+};
+
+static long process_cpu_us(void);
+static void adapt_sample(struct server *sv, struct adapt_sample *s);
+static int adapt_verdict(struct server *sv, struct adapt_sample *prev, struct adapt_sample *cur, int nr_cpus);
+static void *adapt_thread(void *arg);
+
+// user and system time of the server
+static long process_cpu_us(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void adapt_sample(struct server *sv, struct adapt_sample *s) {
+    s->time    = now_us();
+    s->cpu     = process_cpu_us();
+    s->blocked = sv->stats.blocked_us;
+    s->waits   = sv->stats.queue_waits + sv->stats.shed_full;
+}
+
+// 1 if the pool should grow, -1 if it should shrink, 0 if it is right
+static int adapt_verdict(struct server *sv, struct adapt_sample *prev, struct adapt_sample *cur, int nr_cpus) {
+    double interval = cur->time - prev->time;
+    int depth, nr, nr_idle;
+
+    pthread_mutex_lock(&lock);
+    depth   = sv->num_requests;
+    nr      = sv->nr_threads - sv->nr_retiring;
+    nr_idle = sv->nr_idle;
+    pthread_mutex_unlock(&lock);
+
+    double cpu     = (cur->cpu - prev->cpu) / (interval * nr_cpus);
+    double blocked = (cur->blocked - prev->blocked) / (interval * nr);
+    bool waiting   = depth > 0 || cur->waits > prev->waits;
+
+    if (waiting && (cpu < ADAPT_CPU_HIGH || blocked >= ADAPT_BLOCKED))
+        return 1;
+    if (!waiting && nr_idle > nr / 4)
+        return -1;
+    if (cpu >= ADAPT_CPU_HIGH && blocked < ADAPT_BLOCKED / 4 && nr > nr_cpus)
+        return -1;
+    return 0;
+}
+
+static void *adapt_thread(void *arg) {
+    struct server *sv = (struct server *)arg;
+    int nr_cpus       = sysconf(_SC_NPROCESSORS_ONLN);
+    int streak        = 0;  // intervals in a row with the same verdict, negative to shrink
+    struct adapt_sample prev, cur;
+
+    adapt_sample(sv, &prev);
+    while (!sv->exiting) {
+        usleep(ADAPT_INTERVAL * 1000);
+        adapt_sample(sv, &cur);
+        int verdict = adapt_verdict(sv, &prev, &cur, nr_cpus);
+        prev        = cur;
+
+        if (verdict == 0 || (verdict > 0) != (streak > 0))
+            streak = 0;
+        streak += verdict;
+        if (streak < ADAPT_GROW_STREAK && streak > -ADAPT_SHRINK_STREAK)
+            continue;
+        streak = 0;
+
+        pthread_mutex_lock(&lock);
+        int nr = sv->nr_threads - sv->nr_retiring, old_nr = nr;
+        pthread_mutex_unlock(&lock);
+        if (verdict > 0 && nr < sv->adapt_max) {
+            nr += (nr + 3) / 4;  // by a quarter, at least one
+            nr = nr < sv->adapt_max ? nr : sv->adapt_max;
+        } else if (verdict < 0 && nr > sv->adapt_min) {
+            nr--;  // one at a time, growing back is quicker
+        } else {
+            continue;
+        }
+        if ((nr = server_set_threads(sv, nr)) < 0)  // exiting
+            break;
+        if (nr == old_nr)  // no thread could be started
+            continue;
+        if (verdict > 0)
+            STAT_ADD(sv, pool_grows, 1);
+        else
+            STAT_ADD(sv, pool_shrinks, 1);
+        printf("server: adapt: nr_threads = %d\n", nr);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+//# idle connection functions
+static void idle_park(struct server *sv, int fd);
+static void idle_unlink(struct server *sv, struct idle *i);
+static void idle_free(struct server *sv);
+
+// hand a kept-open connection that has no request yet to the acceptor
+static void idle_park(struct server *sv, int fd) {
+    struct idle *i           = (struct idle *)Malloc(sizeof(struct idle));
+    struct epoll_event event = {EPOLLIN | EPOLLRDHUP, {.ptr = i}};
+
+    i->fd    = fd;
+    i->since = now_us();
+    i->next  = NULL;
+    pthread_mutex_lock(&idle_lock);
+    if (sv->exiting) {  // see idle_free
+        pthread_mutex_unlock(&idle_lock);
+        free(i);
+        SYS(close(fd));
+        return;
+    }
+    i->prev = sv->idle_tail;
+    if (sv->idle_tail)
+        sv->idle_tail->next = i;
+    else
+        sv->idle_head = i;
+    sv->idle_tail = i;
+    SYS(epoll_ctl(sv->idle_fd, EPOLL_CTL_ADD, fd, &event));
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// called with the idle lock held
+static void idle_unlink(struct server *sv, struct idle *i) {
+    SYS(epoll_ctl(sv->idle_fd, EPOLL_CTL_DEL, i->fd, NULL));
+    if (i->prev)
+        i->prev->next = i->next;
+    else
+        sv->idle_head = i->next;
+    if (i->next)
+        i->next->prev = i->prev;
+    else
+        sv->idle_tail = i->prev;
+}
+
+// close the idle connections once the workers have exited
+static void idle_free(struct server *sv) {
+    while (sv->idle_head) {
+        struct idle *i = sv->idle_head;
+        sv->idle_head  = i->next;
+        close(i->fd);
+        free(i);
+    }
+    close(sv->idle_fd);
 }
 
 //# entry point functions
+struct conn {  // a connection, kept open for more requests
+    int fd;
+    struct rio *rio;  // holds the requests that the client pipelined
+    bool corked;  // responses are held back, to be sent together
+};
+
+// the disk waits of a request, see blocked_disk
+struct blocked {
+    struct server *sv;
+    long start[2];  // the wall clock and run time when the wait began, in us
+};
+
+static int do_stream_request(struct server *sv, struct request *rq);
+static void conn_cork(struct conn *c, bool cork);
+static bool do_request(struct server *sv, struct conn *c);
 static void do_server_request(struct server *sv, int connfd);
+static void blocked_disk(void *arg, int begin);
 struct server *server_init(int nr_threads, int max_requests, int max_cache_size);
+void server_set_shedding(struct server *sv, int codel_target_ms, int retry_after);
+void server_set_sjf(struct server *sv, double aging);
+void server_set_stream_size(struct server *sv, long stream_size);
+void server_set_keepalive(struct server *sv, int keepalive_ms);
+int server_idle_fd(struct server *sv);
+int server_idle(struct server *sv);
+void server_set_dequeue_batch(struct server *sv, int batch);
+void server_set_cache_map(struct server *sv, int map_flags);
+void server_set_cache_arena(struct server *sv, int slab_flags);
+void server_set_cache_gzip(struct server *sv, int level, int only);
+void server_watch(struct server *sv, const char *dir);
+void server_pin(struct server *sv, const char *worker_cpus, const char *acceptor_cpus);
+void server_warmup(struct server *sv, char *index);
+void server_set_adaptive(struct server *sv, int min_threads, int max_threads);
+int server_set_threads(struct server *sv, int nr_threads);
+int server_set_queue(struct server *sv, int max_requests);
+int server_set_cache_size(struct server *sv, int max_cache_size);
+static struct queued queue_pop(struct server *sv, bool *shed);
+static bool worker_start(struct server *sv, int i);
+static void worker_retire(struct server *sv);
 void create_worker(struct server *sv);  // helper for server_init
 void server_request(struct server *sv, int connfd);
+void server_request_batch(struct server *sv, int *connfds, int nr);
+static void queue_connections(struct server *sv, int *connfds, int nr);
 void server_exit(struct server *sv);
 
-static void do_server_request(struct server *sv, int connfd) {
-    int ret;
+// stream the requested file through a small buffer if it is larger than
+// sv->stream_size, so that large files don't have to fit in memory. parts of a
+// file asked for with a Range header are sent from the file in the same way,
+// since reading all of it to send a part is what streaming avoids. returns 1
+// if the file was streamed, 0 if it should be read in as usual, and -1 if an
+// error was sent.
+static int do_stream_request(struct server *sv, struct request *rq) {
+    struct stat sbuf;
+    unsigned int csum;
+    long sent;
+    char *file_name = request_file_name(rq);
+    bool ranged     = request_has_range(rq);
+
+    if (!request_stat(rq, &sbuf))
+        return -1;
+    if (sbuf.st_size <= sv->stream_size && !ranged)
+        return 0;
+
+    if (stream_buf == NULL)  // kept until the worker exits
+        stream_buf = Malloc(STREAM_CHUNK);
+    if (meta_lookup(file_name, &sbuf, &csum)) {
+        STAT_ADD(sv, meta_hits, 1);
+    } else {  // the checksum is sent before the data, so read the file twice
+        STAT_ADD(sv, meta_misses, 1);
+        csum = request_csumfile(rq, sbuf.st_size, stream_buf, STREAM_CHUNK);
+        meta_insert(file_name, &sbuf, csum);
+    }
+    if (request_not_modified(rq, sbuf.st_size, csum)) {
+        STAT_ADD(sv, not_modified, 1);
+        return 1;
+    }
+    if (ranged && (sent = request_sendfile_ranges(rq, sbuf.st_size, csum)) >= 0) {
+        STAT_ADD(sv, bytes, sent);
+        return 1;
+    }
+    if (sbuf.st_size <= sv->stream_size)  // the range was ignored, send all of it
+        return 0;
+    if (request_streamfile(rq, sbuf.st_size, csum, stream_buf, STREAM_CHUNK) != csum) {
+        // the file changed while it was sent, or since its checksum was
+        // computed without its size or mtime changing. the client sees a
+        // bad checksum, and the next request computes it again.
+        meta_invalidate(file_name, false);
+        STAT_ADD(sv, stream_changed, 1);
+    }
+    STAT_ADD(sv, streamed, 1);
+    STAT_ADD(sv, bytes, sbuf.st_size);
+    return 1;
+}
+
+// hold back partial frames while more responses follow, and send what was held
+// back once they don't
+static void conn_cork(struct conn *c, bool cork) {
+    int on = cork;
+
+    if (c->corked == cork)
+        return;
+    // a unix domain socket has nothing to cork
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0 && errno != EOPNOTSUPP)
+        unix_error("setsockopt");
+    c->corked = cork;
+}
+
+// serve one request on the connection. returns whether the connection can be
+// used for the next one.
+static bool do_request(struct server *sv, struct conn *c) {
+    int ret, map_flags;
+    long sent;
+    bool keep_alive;
     struct request *rq;
     struct file_data *data;
+    struct blocked blocked = {sv};
 
     data = file_data_init();
+    STAT_ADD(sv, requests, 1);
 
     /* fill data->file_name with name of the file being requested */
-    rq = request_init(connfd, data);
+    rq = request_init(c->fd, c->rio, data);
     if (!rq) {
+        STAT_ADD(sv, errors, 1);
         file_data_free(data);
-        return;
+        return false;
     }
+    if (sv->adapt_max > 0)
+        request_set_disk_hook(rq, blocked_disk, &blocked);
+    // the responses to pipelined requests leave together, see do_server_request
+    if (Rio_buffered(c->rio) > 0)
+        conn_cork(c, true);
+    if (request_has_range(rq))
+        STAT_ADD(sv, ranged, 1);
 
     // read file
     if (sv->max_cache_size <= 0) {
-        ret = request_readfile(rq);
+        ret = (sv->stream_size > 0 || request_has_range(rq)) ? do_stream_request(sv, rq) : 0;
         if (ret == 0)
-            request_destroy(rq);
-        else {
-            request_sendfile(rq);
-            request_destroy(rq);
+            ret = request_readfile(rq) ? 0 : -1;
+        if (ret < 0) {
+            STAT_ADD(sv, errors, 1);
+        } else if (ret == 0) {
+            sent = request_sendfile(rq);
+            if (sent >= 0)
+                STAT_ADD(sv, bytes, sent);
+            else
+                STAT_ADD(sv, not_modified, 1);
         }
-        return;
+        goto out;
     }
 
     pthread_mutex_lock(&cache);
-    struct file *file_to_cache = cacheLookup(data->file_name);
-
-    if (file_to_cache)
-        request_set_data(rq, file_to_cache->data);
+    cache_trim(sv, CACHE_TRIM);
+    struct file *file_to_cache = cache_get(data->file_name);
+    unsigned long generation   = cache_table->generation;
+    pthread_mutex_unlock(&cache);
 
-    if (file_to_cache == NULL) {
-        pthread_mutex_unlock(&cache);
-        ret = request_readfile(rq);
+    if (file_to_cache) {
+        STAT_ADD(sv, cache_hits, 1);
+    } else {
+        STAT_ADD(sv, cache_misses, 1);
+        ret = (sv->stream_size > 0 || request_has_range(rq)) ? do_stream_request(sv, rq) : 0;
+        map_flags = cache_table->map_flags;
+        // a mapped file is read by page faults while it is sent, which
+        // the adaptive pool would not see as blocked, so fault it in here
+        if (sv->adapt_max > 0 && (map_flags & REQUEST_MAP))
+            map_flags |= REQUEST_MAP_POPULATE;
+        if (ret == 0)
+            ret = request_mapfile(rq, map_flags) ? 0 : -1;
+        if (ret > 0)  // too large to cache, or only part of it was asked for
+            goto out;
 
-        if (ret == 0)  //can't read file
+        if (ret < 0) {  //can't read file
+            STAT_ADD(sv, errors, 1);
             goto out;
+        }
+        cache_compress(data);
 
         pthread_mutex_lock(&cache);
-
-        file_to_cache = cacheLookup(data->file_name);
-        if (file_to_cache == NULL)
-            file_to_cache = cache_insert(data);
-        else
-            request_set_data(rq, file_to_cache->data);
+        file_to_cache = cache_get(data->file_name);  // another request may have cached it
+        if (file_to_cache == NULL && generation == cache_table->generation) {
+            file_to_cache = cache_insert(sv, data);
+            if (file_to_cache)
+                file_to_cache->refs++;
+        }
+        pthread_mutex_unlock(&cache);
     }
 
-    pthread_mutex_unlock(&cache);
-    request_sendfile(rq);
+    if (file_to_cache)
+        request_set_data(rq, file_to_cache->data);
+    sent = request_sendfile(rq);
+    if (sent >= 0)
+        STAT_ADD(sv, bytes, sent);
+    else
+        STAT_ADD(sv, not_modified, 1);
+    if (request_sent_gzip(rq))
+        STAT_ADD(sv, compressed, 1);
+
+    if (file_to_cache) {
+        pthread_mutex_lock(&cache);
+        cache_put(file_to_cache);
+        pthread_mutex_unlock(&cache);
+    }
 
 out:
+    keep_alive = request_keep_alive(rq);
     request_destroy(rq);
     file_data_free(data);
+    return keep_alive;
+}
+
+// measure the time that a worker waiting for the disk is neither on a cpu nor
+// waiting for one, i.e., that it is blocked, for the adaptive pool. request.c
+// calls this around its reads only, since a send can block on a slow client
+// instead.
+static void blocked_disk(void *arg, int begin) {
+    struct blocked *b = arg;
+    long blocked;
+
+    if (begin) {
+        b->start[0] = now_us();
+        b->start[1] = thread_run_us();
+        return;
+    }
+    blocked = (now_us() - b->start[0]) - (thread_run_us() - b->start[1]);
+    if (blocked > 0)
+        STAT_ADD(b->sv, blocked_us, blocked);
+}
+
+// serve the requests on a connection, in the order they arrive, until the
+// connection is not kept open
+static void do_server_request(struct server *sv, int connfd) {
+    struct conn c = {connfd, Rio_init(connfd), false};
+
+    while (do_request(sv, &c)) {
+        if (Rio_buffered(c.rio) > 0) {  // the next request was pipelined
+            STAT_ADD(sv, pipelined, 1);
+            continue;
+        }
+        // don't wait for the next request here, see idle_park
+        conn_cork(&c, false);
+        Rio_destroy(c.rio);
+        idle_park(sv, connfd);
+        return;
+    }
+    Rio_destroy(c.rio);
+    SYS(close(connfd));
 }
 
 struct server *server_init(int nr_threads, int max_requests, int max_cache_size) {
@@ -231,8 +1543,31 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
     sv                 = (struct server *)Malloc(sizeof(struct server));
     sv->max_requests   = max_requests;
     sv->nr_threads     = nr_threads;
+    sv->nr_retiring    = 0;
+    sv->nr_idle        = 0;
+    sv->adapt_min      = 0;
+    sv->adapt_max      = 0;
+    sv->queue_slots    = max_requests;
     sv->exiting        = 0;
     sv->max_cache_size = max_cache_size;
+    sv->request_times  = NULL;
+    sv->sjf_heap       = NULL;
+    sv->sjf_aging      = 0;
+    sv->stream_size    = max_cache_size;  // files that can't be cached
+    sv->stream_size_set = false;
+    sv->keepalive_ms   = 0;
+    sv->idle_fd        = -1;
+    sv->idle_head      = NULL;
+    sv->idle_tail      = NULL;
+    sv->dequeue_batch  = 1;
+    sv->worker_cpus    = NULL;
+    sv->nr_worker_cpus = 0;
+    sv->shed           = false;
+    sv->watch_fd       = -1;
+    sv->watch_dirs     = NULL;
+    sv->nr_watch_dirs  = 0;
+    memset(&sv->codel, 0, sizeof(sv->codel));
+    memset(&sv->stats, 0, sizeof(sv->stats));
 
     MAX_CACHE_SIZE = max_cache_size;
 
@@ -262,12 +1597,20 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
 
         if (max_cache_size > 0) {
             cache_table           = (struct cache_table *)malloc(sizeof(struct cache_table));
-            cache_table->LRU      = NULL;
+            cache_table->lru_head  = NULL;
+            cache_table->lru_tail  = NULL;
+            cache_table->map_flags = 0;
+            cache_table->arena     = NULL;
+            cache_table->gzip_level = 0;
+            cache_table->gzip_only  = false;
+            cache_table->generation = 0;
             cache_table->currSize = 0;
 
-            cache_table->hash_table = (struct file **)malloc(MAX_CACHE_SIZE * sizeof(struct file *));
-            for (int i = 0; i < MAX_CACHE_SIZE; i++)
-                cache_table->hash_table[i] = NULL;
+            // the index grows with the nr of files, not with the cache size
+            index_init(&cache_table->index, INDEX_MIN_SLOTS);
+            cache_table->old_index.slots = NULL;
+            cache_table->old_index.nr    = 0;
+            cache_table->migrated        = 0;
         }
     }
 
@@ -280,55 +1623,604 @@ struct server *server_init(int nr_threads, int max_requests, int max_cache_size)
     return sv;
 }
 
-void create_worker(struct server *sv) {
-    while (1) {
-        pthread_mutex_lock(&lock);
+/* answer requests with a 503 instead of waiting when the request queue is
+ * full, and when codel_target_ms > 0, also when requests have waited longer
+ * than that in the queue. call before the first server_request. */
+void server_set_shedding(struct server *sv, int codel_target_ms, int retry_after) {
+    if (sv->nr_threads <= 0 || sv->max_requests <= 0)  // no queue
+        return;
 
-        while (sv->num_requests == 0 && !sv->exiting)  // no request, empty buffer, wait
-            pthread_cond_wait(&empty, &lock);
+    request_shed_init(retry_after);
+    sv->shed = true;
+    if (codel_target_ms > 0) {
+        sv->codel.target  = codel_target_ms * 1000L;
+        sv->request_times = (long *)malloc(sizeof(long) * (sv->queue_slots + 1));
+    }
+}
+
+/* serve queued requests in shortest job first order, see struct queued. call
+ * before the first server_request. */
+void server_set_sjf(struct server *sv, double aging) {
+    if (sv->nr_threads <= 0 || sv->max_requests <= 0)  // no queue
+        return;
 
+    sv->sjf_heap  = (struct queued *)malloc(sizeof(struct queued) * sv->queue_slots);
+    sv->sjf_aging = aging;
+}
 
-        // read from buffer
-        int connfd = sv->request_buffer[out];
+/* stream files larger than stream_size bytes instead of reading them into
+ * memory, 0 to never stream. by default, files larger than the cache are
+ * streamed. */
+void server_set_stream_size(struct server *sv, long stream_size) {
+    sv->stream_size     = stream_size;
+    sv->stream_size_set = true;
+}
 
-        if (sv->num_requests == sv->max_requests)  // full buffer, wait
-            pthread_cond_broadcast(&full);
+/* keep the connections of clients that ask for it, e.g., with HTTP/1.1, open
+ * for more requests, until they are idle for keepalive_ms. a client can then
+ * pipeline its requests, and they are answered in order. the caller has to
+ * poll server_idle_fd, and call server_idle. */
+void server_set_keepalive(struct server *sv, int keepalive_ms) {
+    sv->keepalive_ms = keepalive_ms;
+    request_keep_alive_init(keepalive_ms > 0);
+    if (keepalive_ms > 0 && sv->idle_fd < 0)
+        SYS(sv->idle_fd = epoll_create1(EPOLL_CLOEXEC));
+}
+
+/* the fd that is readable when an idle connection is, -1 if there are none */
+int server_idle_fd(struct server *sv) {
+    return sv->idle_fd;
+}
+
+/* queue the idle connections that have a new request, and close those that
+ * were closed by the client, or were idle for keepalive_ms. returns the ms
+ * until this has to be called again, -1 for never. */
+int server_idle(struct server *sv) {
+    struct epoll_event events[IDLE_BATCH];
+    int connfds[IDLE_BATCH];
+    int nr = 0, n, timeout;
+    long now;
+    char byte;
+
+    if (sv->idle_fd < 0)
+        return -1;
+    pthread_mutex_lock(&idle_lock);
+    SYS(n = epoll_wait(sv->idle_fd, events, IDLE_BATCH, 0));
+    for (int j = 0; j < n; j++) {
+        struct idle *i = events[j].data.ptr;
+        idle_unlink(sv, i);
+        // a closed connection is readable too
+        if (recv(i->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+            connfds[nr++] = i->fd;
+        else
+            SYS(close(i->fd));
+        free(i);
+    }
+    now = now_us();
+    while (sv->idle_head && now - sv->idle_head->since >= sv->keepalive_ms * 1000L) {
+        struct idle *i = sv->idle_head;
+        idle_unlink(sv, i);
+        SYS(close(i->fd));
+        free(i);
+        STAT_ADD(sv, idle_timeouts, 1);
+    }
+    // a connection that becomes idle later is closed later than the first
+    // one, or than keepalive_ms from now if there is none
+    if (sv->idle_head)
+        timeout = (sv->idle_head->since + sv->keepalive_ms * 1000L - now + 999) / 1000;
+    else
+        timeout = sv->keepalive_ms;
+    pthread_mutex_unlock(&idle_lock);
+
+    STAT_ADD(sv, resumed, nr);
+    queue_connections(sv, connfds, nr);
+    return timeout;
+}
 
-        sv->num_requests -= 1;  // decrement request number
-        out = (out + 1) % sv->max_requests;
+/* let each worker take up to batch queued connections with one acquisition of
+ * the queue lock, instead of one. a worker takes no more than its share of
+ * the queue. call before the first server_request. */
+void server_set_dequeue_batch(struct server *sv, int batch) {
+    if (batch < 1)
+        batch = 1;
+    if (batch > DEQUEUE_BATCH_MAX)
+        batch = DEQUEUE_BATCH_MAX;
+    sv->dequeue_batch = batch;
+}
+
+/* keep cached files in read-only mappings of the files, instead of on the
+ * heap. map_flags are REQUEST_MAP flags. call before the first server_request
+ * or server_warmup. */
+void server_set_cache_map(struct server *sv, int map_flags) {
+    if (sv->max_cache_size > 0)
+        cache_table->map_flags = map_flags;
+}
+
+/* keep cached files in an arena of max_cache_size bytes, managed by size
+ * class, instead of on the heap, so that the memory used by the cache matches
+ * its size. slab_flags can ask for huge pages. call before the first
+ * server_request or server_warmup. */
+void server_set_cache_arena(struct server *sv, int slab_flags) {
+    if (sv->max_cache_size > 0)
+        cache_table->arena = slab_arena_create(sv->max_cache_size, slab_flags);
+}
+
+/* keep a gzip variant of each cached file that compresses, built at level
+ * (1-9) when the file is inserted, for the clients that accept gzip. both
+ * variants count against the cache size, unless only the gzip variant is
+ * kept, and inflated for each client that doesn't take it. call before the
+ * first server_request or server_warmup. */
+void server_set_cache_gzip(struct server *sv, int level, int only) {
+    if (sv->max_cache_size > 0) {
+        cache_table->gzip_level = level;
+        cache_table->gzip_only  = only;
+    }
+}
+
+/* drop cached files and metadata as soon as the files change on disk, by
+ * watching the directory tree dir in a thread of its own. dir is relative to
+ * the current directory, as the files that are requested are. */
+void server_watch(struct server *sv, const char *dir) {
+    char path[MAXLINE];
+
+    if (dir[0] == '/') {
+        fprintf(stderr, "watch: %s: should be relative to the current directory\n", dir);
+        exit(1);
+    }
+    while (strncmp(dir, "./", 2) == 0)
+        dir += 2;
+    // name the directories as request_parse_URI names the files
+    if (strcmp(dir, ".") == 0 || dir[0] == '\0')
+        snprintf(path, sizeof(path), ".");
+    else
+        snprintf(path, sizeof(path), "./%s", dir);
+    while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+        path[strlen(path) - 1] = '\0';
+
+    SYS(sv->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    watch_add(sv, path);
+    SYS(pthread_create(&sv->watch_thread, NULL, watch_thread, sv));
+}
 
+/* pin each worker thread to one cpu, taken in turn from worker_cpus, and the
+ * calling (acceptor) thread to the cpus in acceptor_cpus. either can be NULL
+ * to leave those threads unpinned, or "auto" to spread the threads over
+ * separate physical cores, with the acceptor on a core of its own when there
+ * are enough cores. the placement is printed, so that runs can be repeated. */
+void server_pin(struct server *sv, const char *worker_cpus, const char *acceptor_cpus) {
+    int spread[CPU_SETSIZE], cpus[CPU_SETSIZE];
+    int nr_spread = cpu_spread(spread);
+    int nr_cpus   = 0;
+    bool auto_acceptor = acceptor_cpus && strcmp(acceptor_cpus, "auto") == 0;
+
+    if (acceptor_cpus) {
+        if (auto_acceptor)
+            cpus[nr_cpus++] = spread[0];
+        else
+            nr_cpus = cpu_parse_list(acceptor_cpus, cpus);
+        cpu_pin(pthread_self(), cpus, nr_cpus);
+        printf("server: placement: acceptor on cpu");
+        for (int i = 0; i < nr_cpus; i++)
+            printf("%c%d", i ? ',' : ' ', cpus[i]);
+        printf("\n");
+    }
+
+    if (worker_cpus && sv->nr_threads > 0) {
+        sv->worker_cpus = (int *)malloc(sizeof(int) * CPU_SETSIZE);
+        if (strcmp(worker_cpus, "auto") == 0) {
+            // leave the acceptor's core to it, unless it is the only one
+            int first = (auto_acceptor && nr_spread > 1) ? 1 : 0;
+            sv->nr_worker_cpus = nr_spread - first;
+            memcpy(sv->worker_cpus, spread + first, sizeof(int) * sv->nr_worker_cpus);
+        } else {
+            sv->nr_worker_cpus = cpu_parse_list(worker_cpus, sv->worker_cpus);
+        }
+        printf("server: placement: workers on cpus");
+        for (int i = 0; i < sv->nr_threads; i++) {
+            int cpu = sv->worker_cpus[i % sv->nr_worker_cpus];
+            cpu_pin(*sv->worker_threads[i], &cpu, 1);
+            printf("%c%d", i ? ',' : ' ', cpu);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/* preload the cache with the files in a fileset index, in index order, until
+ * the cache is full. a binary index is mapped, not parsed, so startup time
+ * depends on the cache size and not on the size of the index. */
+void server_warmup(struct server *sv, char *index) {
+    struct fileidx *idx;
+    int nr_loaded = 0;
+
+    if (sv->max_cache_size <= 0)
+        return;
+
+    idx = fileidx_open(index);
+    for (int i = 0; i < fileidx_nr_files(idx); i++) {
+        if (cache_table->currSize >= MAX_CACHE_SIZE)  // cache is full
+            break;
+        // does not fit, don't evict. a compressed file may fit, so that is checked once it is loaded
+        if (cache_table->gzip_level == 0 && cache_table->currSize + fileidx_size(idx, i) > MAX_CACHE_SIZE)
+            continue;
+
+        struct file_data *data = file_data_init();
+        data->file_name        = Malloc(MAXLINE);
+        // same name as request_parse_URI gives the file
+        snprintf(data->file_name, MAXLINE, "./%s", fileidx_name(idx, i));
+
+        if (request_loadfile(data, cache_table->map_flags)) {
+            cache_compress(data);
+            pthread_mutex_lock(&cache);
+            if (cache_table->currSize + cache_size(data) <= MAX_CACHE_SIZE &&
+                cacheLookup(data->file_name) == NULL && cache_insert(sv, data))
+                nr_loaded++;
+            pthread_mutex_unlock(&cache);
+        }
+        file_data_free(data);
+    }
+    fileidx_close(idx);
+
+    printf("server: warmup_files = %d\n", nr_loaded);
+    fflush(stdout);
+}
+
+/* let the pool of worker threads grow and shrink between min_threads and
+ * max_threads with the load, see adapt_thread, starting from nr_threads, or
+ * the nearest bound. the pool can still be resized with server_set_threads.
+ * call after server_pin, since workers that are added are pinned as it pinned
+ * the others. */
+void server_set_adaptive(struct server *sv, int min_threads, int max_threads) {
+    if (sv->nr_threads <= 0 || sv->max_requests <= 0 || min_threads < 1 || max_threads < min_threads)
+        return;
+
+    sv->adapt_min = min_threads;
+    sv->adapt_max = max_threads;
+    if (sv->nr_threads < min_threads)
+        server_set_threads(sv, min_threads);
+    else if (sv->nr_threads > max_threads)
+        server_set_threads(sv, max_threads);
+    SYS(pthread_create(&sv->adapt_thread, NULL, adapt_thread, sv));
+}
+
+/* grow or shrink the pool of worker threads to nr_threads, while serving. new
+ * workers are pinned as server_pin pinned the others. a worker that is asked
+ * to exit first serves the connections it took off the queue, so that no
+ * request is dropped. returns the new nr of workers, fewer when threads can't
+ * be created, or -1 if the server was started without workers or without a
+ * queue. */
+int server_set_threads(struct server *sv, int nr_threads) {
+    if (sv->nr_threads <= 0 || sv->max_requests <= 0 || nr_threads < 1)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if (sv->exiting) {  // server_exit is joining the workers
         pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    int target = sv->nr_threads - sv->nr_retiring;
+    if (nr_threads < target) {
+        sv->nr_retiring += target - nr_threads;
+        pthread_cond_broadcast(&empty);  // idle workers retire right away
+    } else if (nr_threads > target) {
+        // call off the workers that haven't retired yet, then start new ones
+        int nr_kept = nr_threads - target < sv->nr_retiring ? nr_threads - target : sv->nr_retiring;
+        int nr_new  = nr_threads - target - nr_kept;
+        sv->nr_retiring -= nr_kept;
+        sv->worker_threads = (pthread_t **)realloc(sv->worker_threads, sizeof(pthread_t *) * (sv->nr_threads + nr_new));
+        for (int i = 0; i < nr_new && worker_start(sv, sv->nr_threads); i++)
+            sv->nr_threads++;
+    }
+    nr_threads = sv->nr_threads - sv->nr_retiring;  // fewer if a worker couldn't start
+    pthread_mutex_unlock(&lock);
+    return nr_threads;
+}
+
+/* resize the request queue to max_requests, while serving. the requests that
+ * are queued stay queued, and while there are more of them than fit, the
+ * acceptor waits, or sheds, as it does when the queue is full. returns the new
+ * size, or -1 if the server was started without workers or without a queue. */
+int server_set_queue(struct server *sv, int max_requests) {
+    if (sv->nr_threads <= 0 || sv->max_requests <= 0 || max_requests < 1)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    int slots    = max_requests > sv->num_requests ? max_requests : sv->num_requests;
+    int *buffer  = (int *)malloc(sizeof(int) * (slots + 1));
+    long *times  = sv->request_times ? (long *)malloc(sizeof(long) * (slots + 1)) : NULL;
+    for (int i = 0; i < sv->num_requests; i++) {  // unwrap the ring, oldest first
+        buffer[i] = sv->request_buffer[(out + i) % sv->queue_slots];
+        if (times)
+            times[i] = sv->request_times[(out + i) % sv->queue_slots];
+    }
+    free(sv->request_buffer);
+    free(sv->request_times);
+    sv->request_buffer = buffer;
+    sv->request_times  = times;
+    out                = 0;
+    in                 = sv->num_requests % slots;
+    if (sv->sjf_heap)  // the first num_requests entries are still a heap
+        sv->sjf_heap = (struct queued *)realloc(sv->sjf_heap, sizeof(struct queued) * slots);
+
+    if (max_requests > sv->max_requests)  // there may be room for a waiting acceptor
+        pthread_cond_broadcast(&full);
+    sv->queue_slots  = slots;
+    sv->max_requests = max_requests;
+    pthread_mutex_unlock(&lock);
+    return max_requests;
+}
+
+/* change the cache size to max_cache_size bytes, while serving. when it
+ * shrinks, the least recently used files are evicted a few at a time by the
+ * requests that follow, see cache_trim, and no file is inserted until the
+ * cache fits. the arena can't grow beyond the size it was created with.
+ * unless it was set, the size above which files are streamed follows.
+ * returns the new size, or -1 if the server was started without a cache. */
+int server_set_cache_size(struct server *sv, int max_cache_size) {
+    if (sv->max_cache_size <= 0 || max_cache_size < 1)
+        return -1;
+
+    pthread_mutex_lock(&cache);
+    if (cache_table->arena && (size_t)max_cache_size > slab_size(cache_table->arena))
+        max_cache_size = slab_size(cache_table->arena);
+    MAX_CACHE_SIZE     = max_cache_size;
+    sv->max_cache_size = max_cache_size;
+    if (!sv->stream_size_set)  // still the files that can't be cached
+        sv->stream_size = max_cache_size;
+    pthread_mutex_unlock(&cache);
+    return max_cache_size;
+}
+
+// take the next request off the queue, called with the queue lock held. sets
+// *shed if CoDel sheds it.
+static struct queued queue_pop(struct server *sv, bool *shed) {
+    struct queued q = {-1, 0, 0, 0, true};
+
+    *shed = false;
+    if (sv->sjf_heap) {
+        q = sjf_pop(sv, sv->num_requests);
+    } else {
+        q.connfd = sv->request_buffer[out];
+        if (sv->request_times)
+            q.time = sv->request_times[out];
+        out = (out + 1) % sv->queue_slots;
+    }
+
+    if (sv->codel.target > 0) {
+        long now     = now_us();
+        long sojourn = now - q.time;
+        if (sv->num_requests == 1)  // an empty queue is not a standing queue
+            sojourn = 0;
+        *shed = codel_dequeue(&sv->codel, sojourn, now);
+    }
+
+    sv->num_requests -= 1;  // decrement request number
+    return q;
+}
+
+// start worker i, when the pool grows. called with the queue lock held.
+// returns false if the thread can't be created.
+static bool worker_start(struct server *sv, int i) {
+    int err;
+
+    sv->worker_threads[i] = (pthread_t *)malloc(sizeof(pthread_t));
+    if ((err = pthread_create(sv->worker_threads[i], NULL, (void *)&create_worker, sv)) != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        free(sv->worker_threads[i]);
+        sv->worker_threads[i] = NULL;
+        return false;
+    }
+    if (sv->worker_cpus) {
+        int cpu = sv->worker_cpus[i % sv->nr_worker_cpus];
+        cpu_pin(*sv->worker_threads[i], &cpu, 1);
+    }
+    return true;
+}
+
+// exit the calling worker, when the pool shrinks. called with the queue lock
+// held. the last worker takes its place in the table, so that server_exit
+// joins the workers that are left.
+static void worker_retire(struct server *sv) {
+    pthread_t self = pthread_self();
+    int i          = 0;
+
+    while (!pthread_equal(*sv->worker_threads[i], self))
+        i++;
+    free(sv->worker_threads[i]);
+    sv->worker_threads[i] = sv->worker_threads[--sv->nr_threads];
+    sv->nr_retiring--;
+    pthread_mutex_unlock(&lock);
+
+    pthread_detach(self);  // nobody joins it
+    free(stream_buf);
+    if (schedstat_fd >= 0)
+        close(schedstat_fd);
+    pthread_exit(0);
+}
+
+void create_worker(struct server *sv) {
+    // the workers are running before server_set_dequeue_batch is called
+    struct queued batch[DEQUEUE_BATCH_MAX];
+    bool shed[DEQUEUE_BATCH_MAX];
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+
+        sv->nr_idle++;
+        while (sv->num_requests == 0 && !sv->exiting && sv->nr_retiring == 0)  // no request, empty buffer, wait
+            pthread_cond_wait(&empty, &lock);
+        sv->nr_idle--;
 
         if (sv->exiting) {  // exit
             pthread_mutex_unlock(&lock);
+            free(stream_buf);
+            if (schedstat_fd >= 0)
+                close(schedstat_fd);
             pthread_exit(0);
         }
+        if (sv->nr_retiring > 0)  // the pool shrinks, the others serve the queue
+            worker_retire(sv);
+
+        // read from buffer. claim up to dequeue_batch connections, but no
+        // more than a fair share of the queue, so that the other workers
+        // aren't left idle while this one works through its batch
+        int nr = sv->num_requests / sv->nr_threads;
+        if (nr < 1)
+            nr = 1;
+        if (nr > sv->dequeue_batch)
+            nr = sv->dequeue_batch;
+
+        if (sv->num_requests >= sv->max_requests)  // full buffer, wait
+            pthread_cond_broadcast(&full);
+
+        for (int i = 0; i < nr; i++)
+            batch[i] = queue_pop(sv, &shed[i]);
 
-        do_server_request(sv, connfd);
+        pthread_mutex_unlock(&lock);
+        STAT_ADD(sv, dequeues, 1);
+
+        for (int i = 0; i < nr; i++) {
+            if (shed[i]) {
+                STAT_ADD(sv, shed_codel, 1);
+                request_shed(batch[i].connfd);
+                continue;
+            }
+            if (!batch[i].known && sjf_requeue(sv, &batch[i]))
+                continue;
+            do_server_request(sv, batch[i].connfd);
+        }
     }
 }
 
 void server_request(struct server *sv, int connfd) {
+    server_request_batch(sv, &connfd, 1);
+}
+
+/* queue the nr connections in connfds, e.g., all those accepted at once, with
+ * one acquisition of the queue lock and one wakeup of the workers */
+void server_request_batch(struct server *sv, int *connfds, int nr) {
+    STAT_ADD(sv, connections, nr);
+    if (nr > 0)
+        STAT_ADD(sv, accept_batches, 1);
+    queue_connections(sv, connfds, nr);
+}
+
+/* queue new or idle connections, with one acquisition of the queue lock */
+static void queue_connections(struct server *sv, int *connfds, int nr) {
+    if (nr == 0)
+        return;
     if (sv->nr_threads == 0) { /* no worker threads */
-        do_server_request(sv, connfd);
-    } else {
-        /*  Save the relevant info in a buffer and have one of the
-         *  worker threads do the work. */
-        pthread_mutex_lock(&lock);
+        for (int i = 0; i < nr; i++)
+            do_server_request(sv, connfds[i]);
+        return;
+    }
+
+    /*  Save the relevant info in a buffer and have one of the
+     *  worker threads do the work. */
+    struct queued q[nr];
+    for (int i = 0; i < nr; i++) {
+        q[i] = (struct queued){connfds[i], 0, 0, 0, false};
+        if (sv->sjf_heap) {  // peek at the request before taking the lock
+            q[i].arrival = now_us();
+            sjf_key(sv, &q[i], true);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    bool was_empty = sv->num_requests == 0;
+
+    for (int i = 0; i < nr; i++) {
+        if (sv->num_requests >= sv->max_requests && sv->shed) {  // don't make the acceptor wait
+            STAT_ADD(sv, shed_full, 1);
+            request_shed(q[i].connfd);
+            continue;
+        }
+
+        if (sv->num_requests >= sv->max_requests) {
+            sv->stats.queue_waits++;
+            if (was_empty)  // the workers have to know about the queued requests to make room
+                pthread_cond_broadcast(&empty);
+            was_empty = false;
+        }
 
-        while (sv->max_requests == sv->num_requests)
+        while (sv->num_requests >= sv->max_requests)
             pthread_cond_wait(&full, &lock);  // do not need to check exit?
 
-        sv->request_buffer[in] = connfd;
+        if (sv->codel.target > 0)
+            q[i].time = now_us();
 
-        if (sv->num_requests == 0)
-            pthread_cond_broadcast(&empty);
+        if (sv->sjf_heap) {
+            sjf_push(sv, sv->num_requests, q[i]);
+        } else {
+            sv->request_buffer[in] = q[i].connfd;
+            if (sv->request_times)
+                sv->request_times[in] = q[i].time;
+            in = (in + 1) % sv->queue_slots;
+        }
 
         sv->num_requests += 1;
-        in = (in + 1) % sv->max_requests;
+    }
 
-        pthread_mutex_unlock(&lock);
+    if (was_empty && sv->num_requests > 0)
+        pthread_cond_broadcast(&empty);
+
+    pthread_mutex_unlock(&lock);
+}
+
+/* print the counters, one "server: name = value" line each, so that scripts
+ * can collect them from the server log */
+static void server_print_stats(struct server *sv) {
+    struct server_stats *st = &sv->stats;
+
+    printf("server: nr_threads = %d\n", sv->nr_threads);
+    printf("server: max_requests = %d\n", sv->max_requests);
+    printf("server: max_cache_size = %d\n", sv->max_cache_size);
+    printf("server: requests = %ld\n", st->requests);
+    printf("server: connections = %ld\n", st->connections);
+    if (sv->keepalive_ms > 0) {
+        printf("server: pipelined = %ld\n", st->pipelined);
+        printf("server: resumed = %ld\n", st->resumed);
+        printf("server: idle_timeouts = %ld\n", st->idle_timeouts);
     }
+    printf("server: errors = %ld\n", st->errors);
+    printf("server: bytes = %ld\n", st->bytes);
+    printf("server: not_modified = %ld\n", st->not_modified);
+    printf("server: ranged = %ld\n", st->ranged);
+    printf("server: accept_batches = %ld\n", st->accept_batches);
+    printf("server: queue_waits = %ld\n", st->queue_waits);
+    printf("server: dequeues = %ld\n", st->dequeues);
+    if (sv->adapt_max > 0) {
+        printf("server: pool_grows = %ld\n", st->pool_grows);
+        printf("server: pool_shrinks = %ld\n", st->pool_shrinks);
+        printf("server: blocked_ms = %ld\n", st->blocked_us / 1000);
+    }
+    printf("server: shed_full = %ld\n", st->shed_full);
+    printf("server: shed_codel = %ld\n", st->shed_codel);
+    printf("server: sjf_unknown = %ld\n", st->sjf_unknown);
+    printf("server: streamed = %ld\n", st->streamed);
+    printf("server: stream_changed = %ld\n", st->stream_changed);
+    printf("server: meta_hits = %ld\n", st->meta_hits);
+    printf("server: meta_misses = %ld\n", st->meta_misses);
+    printf("server: cache_hits = %ld\n", st->cache_hits);
+    printf("server: cache_misses = %ld\n", st->cache_misses);
+    printf("server: cache_inserts = %ld\n", st->cache_inserts);
+    printf("server: cache_evictions = %ld\n", st->cache_evictions);
+    if (sv->max_cache_size > 0 && cache_table->gzip_level > 0) {
+        printf("server: cache_compressed = %ld\n", st->cache_compressed);
+        printf("server: compressed = %ld\n", st->compressed);
+    }
+    if (sv->watch_fd >= 0) {
+        printf("server: invalidations = %ld\n", st->invalidations);
+        printf("server: watch_overflows = %ld\n", st->watch_overflows);
+    }
+    printf("server: cache_size = %d\n", sv->max_cache_size > 0 ? cache_table->currSize : 0);
+    if (sv->max_cache_size > 0 && cache_table->arena) {
+        printf("server: cache_arena_allocated = %zu\n", slab_allocated(cache_table->arena));
+        printf("server: cache_arena_used = %zu\n", slab_used(cache_table->arena));
+        printf("server: cache_arena_huge = %zu\n", slab_huge(cache_table->arena));
+    }
+    printf("server: cache_index_slots = %u\n", sv->max_cache_size > 0 ? cache_table->index.mask + 1 : 0);
+    fflush(stdout);
 }
 
 void server_exit(struct server *sv) {
@@ -336,7 +2228,11 @@ void server_exit(struct server *sv) {
      * these threads that the server is exiting. make sure to call
      * pthread_join in this function so that the main server thread waits
      * for all the worker threads to exit before exiting. */
-    sv->exiting = 1;
+    pthread_mutex_lock(&lock);
+    sv->exiting = 1;  // no worker retires after this, the table stays as it is
+    pthread_mutex_unlock(&lock);
+    if (sv->adapt_max > 0)  // nor is one started
+        pthread_join(sv->adapt_thread, NULL);
 
     /* make sure to free any allocated resources */
     pthread_cond_broadcast(&empty);  // no need to broadcast full
@@ -344,12 +2240,29 @@ void server_exit(struct server *sv) {
     for (int i = 0; i < sv->nr_threads; ++i) {
         pthread_join(*sv->worker_threads[i], NULL);
     }
+    if (sv->watch_fd >= 0) {
+        pthread_join(sv->watch_thread, NULL);
+        close(sv->watch_fd);
+        for (int i = 0; i < sv->nr_watch_dirs; i++)
+            free(sv->watch_dirs[i]);
+        free(sv->watch_dirs);
+    }
+    if (sv->idle_fd >= 0)
+        idle_free(sv);
+
+    server_print_stats(sv);
 
     for (int i = 0; i < sv->nr_threads; ++i) {
         free((sv->worker_threads)[i]);
     }
 
     free(sv->request_buffer);
+    free(sv->request_times);
+    free(sv->sjf_heap);
+    free(sv->worker_cpus);
+    meta_free();
+    if (sv->max_cache_size > 0)
+        cache_free();
     free(sv->worker_threads);
 
     free(sv);
@@ -5,7 +5,27 @@ struct server;
 
 struct server *server_init(int nr_threads, int max_requests, 
 			   int max_cache_size);
+void server_set_shedding(struct server *sv, int codel_target_ms,
+			  int retry_after);
+void server_set_sjf(struct server *sv, double aging);
+void server_set_stream_size(struct server *sv, long stream_size);
+void server_set_keepalive(struct server *sv, int keepalive_ms);
+int server_idle_fd(struct server *sv);
+int server_idle(struct server *sv);
+void server_set_dequeue_batch(struct server *sv, int batch);
+void server_set_cache_map(struct server *sv, int map_flags);
+void server_set_cache_arena(struct server *sv, int slab_flags);
+void server_set_cache_gzip(struct server *sv, int level, int only);
+void server_watch(struct server *sv, const char *dir);
+void server_pin(struct server *sv, const char *worker_cpus,
+		const char *acceptor_cpus);
+void server_warmup(struct server *sv, char *index);
+void server_set_adaptive(struct server *sv, int min_threads, int max_threads);
+int server_set_threads(struct server *sv, int nr_threads);
+int server_set_queue(struct server *sv, int max_requests);
+int server_set_cache_size(struct server *sv, int max_cache_size);
 void server_request(struct server *sv, int connfd);
+void server_request_batch(struct server *sv, int *connfds, int nr);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,450 @@
+/*
+ * slab.c: A size class allocator for cached file data.
+ *
+ * The arena is divided into pages. An object larger than SLAB_MAX_SMALL gets a
+ * run of pages of its own (an extent). Smaller objects are rounded up to one
+ * of the size classes, and are carved from a slab, a run of SLAB_PAGES pages
+ * that holds objects of one class. Free page runs are kept in bins by size,
+ * and are merged with their free neighbours when they are freed, so that
+ * allocating and freeing take constant time, and the arena doesn't fragment
+ * into runs that are too small for large files.
+ *
+ * With huge pages, the arena is aligned to HUGE_PAGE, so that the TLB can
+ * cover all of it with huge pages, and touching a page of a file that is being
+ * summed or sent doesn't cost a TLB miss every 4KB.
+ */
+
+#include "common.h"
+#include "slab.h"
+
+#define SLAB_PAGE 4096
+#define SLAB_PAGES 16		/* pages in a slab */
+#define SLAB_BYTES (SLAB_PAGE * SLAB_PAGES)
+#define SLAB_MAX_SMALL (SLAB_BYTES / 4)
+#define SLAB_NR_BINS 32
+#define SLAB_MAX_CLASSES 64
+#define NO_PAGE UINT32_MAX
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+enum page_state {
+	PAGE_FREE,
+	PAGE_SLAB,
+	PAGE_EXTENT,
+};
+
+/* the state of a run of pages is kept in its first page. the last page of a
+ * run also knows where the run starts, so that a run being freed can find a
+ * free run just before it. all the pages of a slab know where it starts. */
+struct page {
+	uint32_t first;		/* first page of the run */
+	uint32_t nr_pages;	/* pages in the run */
+	uint8_t state;
+	uint8_t class;		/* size class of a slab */
+	uint16_t nr_free;	/* free objects in a slab */
+	uint16_t nr_carved;	/* objects of a slab that have been used */
+	void *free_list;	/* freed objects of a slab */
+	uint32_t prev;		/* links in a bin, or in a list of partial slabs */
+	uint32_t next;
+};
+
+struct slab_arena {
+	char *base;
+	size_t size;
+	size_t map_size;	/* size of the mapping, which may be larger */
+	int hugetlb;		/* the mapping is made of reserved huge pages */
+	uint32_t nr_pages;
+	struct page *pages;
+	uint32_t bins[SLAB_NR_BINS];	/* free runs of 2^i to 2^(i+1)-1 pages */
+	uint32_t bin_mask;		/* the bins that are not empty */
+	int nr_classes;
+	int class_size[SLAB_MAX_CLASSES];
+	uint32_t partial[SLAB_MAX_CLASSES];	/* slabs with free objects */
+	size_t allocated;
+	size_t used_pages;
+};
+
+/* 16 byte steps up to 128 bytes, then 4 steps per doubling */
+static void
+slab_init_classes(struct slab_arena *a)
+{
+	int size, base, i;
+
+	a->nr_classes = 0;
+	for (size = 16; size <= 128; size += 16) {
+		a->class_size[a->nr_classes++] = size;
+	}
+	for (base = 128; base < SLAB_MAX_SMALL; base *= 2) {
+		for (i = 1; i <= 4; i++) {
+			a->class_size[a->nr_classes++] = base + i * base / 4;
+		}
+	}
+	assert(a->nr_classes <= SLAB_MAX_CLASSES);
+	assert(a->class_size[a->nr_classes - 1] == SLAB_MAX_SMALL);
+}
+
+/* the smallest class that fits size */
+static int
+slab_class(struct slab_arena *a, size_t size)
+{
+	int lo = 0, hi = a->nr_classes - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (a->class_size[mid] >= size)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static int
+slab_bin(uint32_t nr_pages)
+{
+	return 31 - __builtin_clz(nr_pages);
+}
+
+static void
+slab_list_add(struct slab_arena *a, uint32_t *head, uint32_t p)
+{
+	a->pages[p].prev = NO_PAGE;
+	a->pages[p].next = *head;
+	if (*head != NO_PAGE)
+		a->pages[*head].prev = p;
+	*head = p;
+}
+
+static void
+slab_list_del(struct slab_arena *a, uint32_t *head, uint32_t p)
+{
+	struct page *pg = &a->pages[p];
+
+	if (pg->prev != NO_PAGE)
+		a->pages[pg->prev].next = pg->next;
+	else
+		*head = pg->next;
+	if (pg->next != NO_PAGE)
+		a->pages[pg->next].prev = pg->prev;
+}
+
+/* make pages p to p + n - 1 a run in the given state */
+static void
+run_set(struct slab_arena *a, uint32_t p, uint32_t n, enum page_state state)
+{
+	a->pages[p].state = state;
+	a->pages[p].first = p;
+	a->pages[p].nr_pages = n;
+	a->pages[p + n - 1].first = p;
+	a->pages[p + n - 1].nr_pages = n;
+}
+
+static void
+run_bin_add(struct slab_arena *a, uint32_t p, uint32_t n)
+{
+	int b = slab_bin(n);
+
+	run_set(a, p, n, PAGE_FREE);
+	slab_list_add(a, &a->bins[b], p);
+	a->bin_mask |= 1u << b;
+}
+
+static void
+run_bin_del(struct slab_arena *a, uint32_t p)
+{
+	int b = slab_bin(a->pages[p].nr_pages);
+
+	slab_list_del(a, &a->bins[b], p);
+	if (a->bins[b] == NO_PAGE)
+		a->bin_mask &= ~(1u << b);
+}
+
+static uint32_t
+run_alloc(struct slab_arena *a, uint32_t n, enum page_state state)
+{
+	int b = slab_bin(n);
+	uint32_t p, m, higher;
+
+	/* a run in bin b may be too small, a run in a higher bin is not */
+	if (a->bins[b] != NO_PAGE && a->pages[a->bins[b]].nr_pages >= n) {
+		p = a->bins[b];
+	} else {
+		higher = (b == SLAB_NR_BINS - 1) ? 0 :
+			a->bin_mask & ~((2u << b) - 1);
+		if (!higher)
+			return NO_PAGE;
+		p = a->bins[__builtin_ctz(higher)];
+	}
+	m = a->pages[p].nr_pages;
+	run_bin_del(a, p);
+	if (m > n)
+		run_bin_add(a, p + n, m - n);
+	run_set(a, p, n, state);
+	a->used_pages += n;
+	return p;
+}
+
+static void
+run_free(struct slab_arena *a, uint32_t p)
+{
+	uint32_t n = a->pages[p].nr_pages;
+	uint32_t q;
+
+	a->used_pages -= n;
+	/* merge with a free run just before */
+	if (p > 0) {
+		q = a->pages[p - 1].first;
+		if (a->pages[q].state == PAGE_FREE &&
+		    q + a->pages[q].nr_pages == p) {
+			run_bin_del(a, q);
+			n += a->pages[q].nr_pages;
+			p = q;
+		}
+	}
+	/* and just after */
+	q = p + n;
+	if (q < a->nr_pages && a->pages[q].state == PAGE_FREE) {
+		run_bin_del(a, q);
+		n += a->pages[q].nr_pages;
+	}
+	run_bin_add(a, p, n);
+}
+
+/* reserve size bytes at a HUGE_PAGE boundary, by trimming a larger mapping */
+static char *
+slab_map_aligned(size_t size)
+{
+	char *p, *base;
+	size_t head;
+
+	p = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		unix_error("mmap");
+	base = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+	head = base - p;
+	if (head > 0)
+		SYS(munmap(p, head));
+	SYS(munmap(base + size, HUGE_PAGE - head));
+	return base;
+}
+
+static void
+slab_map(struct slab_arena *a, int flags)
+{
+	a->hugetlb = 0;
+	if (!(flags & (SLAB_HUGE | SLAB_HUGETLB))) {
+		/* pages are only backed by memory when they are first used */
+		a->map_size = a->size;
+		a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+		if (a->base == MAP_FAILED)
+			unix_error("mmap");
+		return;
+	}
+	a->map_size = (a->size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+	if (flags & SLAB_HUGETLB) {
+		a->base = mmap(NULL, a->map_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			       -1, 0);
+		if (a->base != MAP_FAILED) {
+			a->hugetlb = 1;
+			return;
+		}
+		/* usually, no huge pages have been reserved */
+		fprintf(stderr, "mmap: MAP_HUGETLB: %s, using transparent "
+			"huge pages\n", strerror(errno));
+	}
+#endif
+	a->base = slab_map_aligned(a->map_size);
+#ifdef MADV_HUGEPAGE
+	/* fails when the kernel has no transparent huge pages, in which case
+	 * the arena is made of small pages, as without SLAB_HUGE */
+	if (madvise(a->base, a->map_size, MADV_HUGEPAGE) < 0)
+		fprintf(stderr, "madvise: MADV_HUGEPAGE: %s\n",
+			strerror(errno));
+#endif
+}
+
+struct slab_arena *
+slab_arena_create(size_t size, int flags)
+{
+	struct slab_arena *a;
+	int i;
+
+	a = Malloc(sizeof(struct slab_arena));
+	size = (size + SLAB_PAGE - 1) / SLAB_PAGE * SLAB_PAGE;
+	if (size < SLAB_BYTES)
+		size = SLAB_BYTES;
+	a->size = size;
+	a->nr_pages = size / SLAB_PAGE;
+	slab_map(a, flags);
+	a->pages = calloc(a->nr_pages, sizeof(struct page));
+	if (!a->pages)
+		unix_error("calloc");
+	for (i = 0; i < SLAB_NR_BINS; i++) {
+		a->bins[i] = NO_PAGE;
+	}
+	a->bin_mask = 0;
+	slab_init_classes(a);
+	for (i = 0; i < SLAB_MAX_CLASSES; i++) {
+		a->partial[i] = NO_PAGE;
+	}
+	a->allocated = 0;
+	a->used_pages = 0;
+	run_bin_add(a, 0, a->nr_pages);
+	return a;
+}
+
+void
+slab_arena_destroy(struct slab_arena *a)
+{
+	SYS(munmap(a->base, a->map_size));
+	free(a->pages);
+	free(a);
+}
+
+static void *
+slab_alloc_small(struct slab_arena *a, int c)
+{
+	int size = a->class_size[c];
+	uint32_t s = a->partial[c];
+	struct page *pg;
+	void *obj;
+	int i;
+
+	if (s == NO_PAGE) {	/* start a new slab */
+		s = run_alloc(a, SLAB_PAGES, PAGE_SLAB);
+		if (s == NO_PAGE)
+			return NULL;
+		for (i = 0; i < SLAB_PAGES; i++) {
+			a->pages[s + i].first = s;
+		}
+		pg = &a->pages[s];
+		pg->class = c;
+		pg->free_list = NULL;
+		pg->nr_free = SLAB_BYTES / size;
+		pg->nr_carved = 0;
+		slab_list_add(a, &a->partial[c], s);
+	}
+	pg = &a->pages[s];
+	if (pg->free_list) {
+		obj = pg->free_list;
+		pg->free_list = *(void **)obj;
+	} else {
+		/* objects are carved in order, so a new slab costs nothing */
+		obj = a->base + (size_t)s * SLAB_PAGE + pg->nr_carved++ * size;
+	}
+	if (--pg->nr_free == 0)
+		slab_list_del(a, &a->partial[c], s);
+	a->allocated += size;
+	return obj;
+}
+
+static void
+slab_free_small(struct slab_arena *a, uint32_t s, void *obj)
+{
+	struct page *pg = &a->pages[s];
+	int c = pg->class;
+
+	*(void **)obj = pg->free_list;
+	pg->free_list = obj;
+	if (pg->nr_free++ == 0)
+		slab_list_add(a, &a->partial[c], s);
+	a->allocated -= a->class_size[c];
+	/* give an empty slab back, so its pages can be used by any class */
+	if (pg->nr_free == SLAB_BYTES / a->class_size[c]) {
+		slab_list_del(a, &a->partial[c], s);
+		run_free(a, s);
+	}
+}
+
+void *
+slab_alloc(struct slab_arena *a, size_t size)
+{
+	uint32_t p, n;
+
+	if (size == 0)
+		size = 1;
+	if (size <= SLAB_MAX_SMALL)
+		return slab_alloc_small(a, slab_class(a, size));
+	if (size > a->size)
+		return NULL;
+	n = (size + SLAB_PAGE - 1) / SLAB_PAGE;
+	p = run_alloc(a, n, PAGE_EXTENT);
+	if (p == NO_PAGE)
+		return NULL;
+	a->allocated += (size_t)n * SLAB_PAGE;
+	return a->base + (size_t)p * SLAB_PAGE;
+}
+
+void
+slab_free(struct slab_arena *a, void *p)
+{
+	uint32_t page;
+
+	assert(slab_owns(a, p));
+	page = ((char *)p - a->base) / SLAB_PAGE;
+	if (a->pages[page].first == page &&
+	    a->pages[page].state == PAGE_EXTENT) {
+		a->allocated -= (size_t)a->pages[page].nr_pages * SLAB_PAGE;
+		run_free(a, page);
+	} else {
+		assert(a->pages[a->pages[page].first].state == PAGE_SLAB);
+		slab_free_small(a, a->pages[page].first, p);
+	}
+}
+
+int
+slab_owns(struct slab_arena *a, void *p)
+{
+	return (char *)p >= a->base && (char *)p < a->base + a->size;
+}
+
+size_t
+slab_allocated(struct slab_arena *a)
+{
+	return a->allocated;
+}
+
+size_t
+slab_used(struct slab_arena *a)
+{
+	return a->used_pages * SLAB_PAGE;
+}
+
+size_t
+slab_size(struct slab_arena *a)
+{
+	return a->size;
+}
+
+/* the arena is one mapping, so its entry in smaps is the one that starts at
+ * base. its huge pages are counted as AnonHugePages when they are transparent,
+ * and as Private_Hugetlb when they are reserved. */
+size_t
+slab_huge(struct slab_arena *a)
+{
+	char line[MAXLINE];
+	unsigned long start, end, kb;
+	size_t huge = 0;
+	int found = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/smaps", "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (found)
+				break;
+			found = (start == (uintptr_t)a->base);
+		} else if (found &&
+			   (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+			    sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)) {
+			huge += (size_t)kb * 1024;
+		}
+	}
+	fclose(f);
+	return huge;
+}
@@ -0,0 +1,33 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+/*
+ * A memory manager for cached file data. All memory comes from one arena of a
+ * fixed size, so that the memory used by the cache is the arena, however
+ * much the file sizes churn. See slab.c.
+ */
+
+struct slab_arena;
+
+/* slab_arena_create flags */
+#define SLAB_HUGE 0x1		/* ask for transparent huge pages */
+#define SLAB_HUGETLB 0x2	/* use reserved huge pages, or else SLAB_HUGE */
+
+/* exits if the arena can't be reserved */
+struct slab_arena *slab_arena_create(size_t size, int flags);
+void slab_arena_destroy(struct slab_arena *a);
+/* returns NULL when there is no room in the arena */
+void *slab_alloc(struct slab_arena *a, size_t size);
+void slab_free(struct slab_arena *a, void *p);
+/* whether p was allocated from the arena */
+int slab_owns(struct slab_arena *a, void *p);
+
+/* bytes given out, including the rounding up to size classes and pages */
+size_t slab_allocated(struct slab_arena *a);
+/* bytes of the arena that are in slabs or large objects */
+size_t slab_used(struct slab_arena *a);
+size_t slab_size(struct slab_arena *a);
+/* bytes of the arena that are backed by huge pages, from /proc/self/smaps */
+size_t slab_huge(struct slab_arena *a);
+
+#endif /* __SLAB_H__ */